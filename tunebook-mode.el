@@ -29,12 +29,16 @@
           (string-join
            (list "\\("
                  (string-join
-                  '("add" "am" "attack" "base" "clip" "decay" "detune"
-                    "env" "fm" "groove" "hz" "instrument" "include"
-                    "legato" "modulate" "noise" "pm" "release" "repeat"
-                    "rest" "root" "r" "saw" "section"  "sine" "sin"
-                    "song" "sqr" "square" "sub" "sustain" "tempo"
-                    "triangle" "tri" "voice" "volume")
+                  '("add" "am" "attack" "bandpass" "base" "bus"
+                    "channels" "clip" "cutoff" "decay" "detune" "env"
+                    "fm" "groove" "harmonics" "highpass" "hz" "include"
+                    "instrument" "legato" "lfo" "loop" "lowpass"
+                    "modulate" "noise" "oversample" "pan" "pm"
+                    "polyphony" "release" "repeat" "resonance" "rest"
+                    "reverb" "root" "r" "saw" "section" "send" "sine"
+                    "sin" "song" "sqr" "square" "sub" "sustain" "tempo"
+                    "triangle" "tri" "unison" "voice" "volume"
+                    "wavetable")
                   "\\|")
                  "\\)"))
           'font-lock-keyword-face)))
@@ -1,16 +1,33 @@
+#define _GNU_SOURCE
+#include <complex.h>
 #include <ctype.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 #define SAMPLE int16_t
 #define SAMPLE_MAX INT16_MAX
 #define SAMPLE_RATE 48000
 #define NOISE_SEED 0xdeadbeef
 #define MAX_NOISE_STEPS SAMPLE_RATE
+#define MAX_UNISON 64
+#define MAX_CHANNELS 8
+#define MAX_OVERSAMPLE 16
 #define NEW(target, size) target = malloc((size) * sizeof *target)
 #define RESIZE(target, size) target = realloc(target, (size) * sizeof *target)
 
@@ -58,29 +75,44 @@ struct tunebook_token {
     TOKEN_ADD,
     TOKEN_AM,
     TOKEN_ATTACK,
+    TOKEN_BANDPASS,
     TOKEN_BASE,
+    TOKEN_BUS,
+    TOKEN_CHANNELS,
     TOKEN_CHORD_END,
     TOKEN_CHORD_START,
     TOKEN_CLIP,
+    TOKEN_CUTOFF,
     TOKEN_DECAY,
     TOKEN_DETUNE,
     TOKEN_ENV,
     TOKEN_FM,
     TOKEN_GROOVE,
+    TOKEN_HARMONICS,
+    TOKEN_HIGHPASS,
     TOKEN_HZ,
     TOKEN_INCLUDE,
     TOKEN_INSTRUMENT,
     TOKEN_LEGATO,
+    TOKEN_LFO,
+    TOKEN_LOOP,
+    TOKEN_LOWPASS,
     TOKEN_MODULATE,
     TOKEN_NOISE,
     TOKEN_NUMBER,
+    TOKEN_OVERSAMPLE,
+    TOKEN_PAN,
     TOKEN_PM,
+    TOKEN_POLYPHONY,
     TOKEN_RELEASE,
     TOKEN_REPEAT,
+    TOKEN_RESONANCE,
     TOKEN_REST,
+    TOKEN_REVERB,
     TOKEN_ROOT,
     TOKEN_SAW,
     TOKEN_SECTION,
+    TOKEN_SEND,
     TOKEN_SINE,
     TOKEN_SONG,
     TOKEN_SQUARE,
@@ -89,34 +121,111 @@ struct tunebook_token {
     TOKEN_SUSTAIN,
     TOKEN_TEMPO,
     TOKEN_TRIANGLE,
+    TOKEN_UNISON,
     TOKEN_VOICE,
     TOKEN_VOLUME,
+    TOKEN_WAVETABLE,
   } type;
   union {
     struct tunebook_number number;
     char *string;
   } as;
+  int line;
 };
 
 struct tunebook_instrument {
   char *name;
-  int n_oscillators;
+  int linked, prepared, n_oscillators;
+  // how many times the sample rate the instrument is computed at, before
+  // it is filtered back down
+  int oversample;
   struct tunebook_oscillator *oscillators;
+  void (* kernel)
+  (int carrier, int point, int n, int beat_length, const double *freq,
+   double *buffers, int stride, const double *noise_table);
+  // the instrument in the include cache this is a copy of, if any, which
+  // is linked and prepared once for every book using it
+  struct tunebook_instrument *origin;
+};
+
+// a raw file of samples mapped into memory, shared by every oscillator
+// which plays it
+struct tunebook_wavetable {
+  char *path;
+  struct timespec mtime;
+  const unsigned char *bytes;
+  long n_samples;
+  struct tunebook_wavetable *next;
+};
+
+// a resolved input of an oscillator: the oscillator at index `source`
+// feeds into this one as the given kind of modulation
+struct tunebook_route {
+  enum { ROUTE_AM, ROUTE_FM, ROUTE_PM, ROUTE_ADD, ROUTE_SUB, ROUTE_ENV, ROUTE_CUTOFF } kind;
+  int source;
+};
+
+enum tunebook_shape {
+  OSC_SINE, OSC_SAW, OSC_TRIANGLE, OSC_SQUARE, OSC_NOISE, OSC_HARMONICS, OSC_WAVETABLE, OSC_BUS
+};
+
+// a low frequency oscillator shared by every voice of a song, read by
+// instruments through bus oscillators; its wave is worked out once for
+// each control period of the song, as far as the song has been rendered
+struct tunebook_lfo {
+  char *name;
+  enum tunebook_shape shape;
+  double hz;
+  long n_values;
+  double *values;
 };
 
 struct tunebook_oscillator {
   char *name;
-  enum { OSC_SINE, OSC_SAW, OSC_TRIANGLE, OSC_SQUARE, OSC_NOISE } shape;
+  enum tunebook_shape shape;
   double attack, decay, sustain, release, volume, hz, detune, clip;
-  int n_am_targets, n_fm_targets, n_pm_targets, n_add_targets, n_sub_targets, n_env_targets;
-  char **am_targets, **fm_targets, **pm_targets, **add_targets, **sub_targets, **env_targets;
+  // the amplitude of every harmonic, from the fundamental up, for the
+  // harmonics shape
+  struct tunebook_chord partials;
+  // how many detuned copies of the wave are played together, and how
+  // far apart the outermost copies are as a fraction of the frequency
+  int unison;
+  double spread;
+  // the raw file played by the wavetable shape, and whether it loops
+  char *wavetable;
+  int loop;
+  // the song's lfo read by the bus shape
+  char *bus;
+  // an optional resonant filter between the wave and the envelope, with
+  // its cutoff in Hertz; cutoff modulation moves it by octaves
+  enum { FILTER_NONE, FILTER_LOWPASS, FILTER_HIGHPASS, FILTER_BANDPASS } filter;
+  double cutoff, resonance;
+  int n_am_targets, n_fm_targets, n_pm_targets, n_add_targets, n_sub_targets, n_env_targets,
+    n_cutoff_targets;
+  char **am_targets, **fm_targets, **pm_targets, **add_targets, **sub_targets, **env_targets,
+    **cutoff_targets;
+  // filled in by tunebook_link_book
+  int modulator, n_routes;
+  struct tunebook_route *routes;
+  // filled in by tunebook_prepare_instrument; peak bounds what the
+  // oscillator puts out before its envelope
+  int control_rate, level, n_order, *order, oversample;
+  double *unison_ratios, *unison_phases, peak;
+  struct tunebook_wavetable *table;
+  // filled in as each voice is rendered, from its song
+  struct tunebook_lfo *lfo;
 };
 
 struct tunebook_song {
-  char *name;
+  char *name, *reverb;
   double tempo, root;
-  int n_voices;
+  // how many channels the song is written with, interleaved
+  int channels;
+  // whether the voices and lfos belong to the include cache
+  int cached;
+  int n_voices, n_lfos;
   struct tunebook_voice *voices;
+  struct tunebook_lfo *lfos;
 };
 
 struct tunebook_book {
@@ -126,29 +235,44 @@ struct tunebook_book {
 };
 
 struct tunebook_voice {
-  char *instrument;
-  int n_commands;
-  struct tunebook_voice_command *commands;
+  char *instrument, *source;
+  double send;
+  // where the voice sits across the song's channels, from -1 at the
+  // first to 1 at the last
+  double pan;
+  // the most notes the voice sounds at once, or 0 for no limit
+  int polyphony;
+  int instrument_i, n_commands, n_notes, n_numbers;
+  // the commands, packed into parallel arrays: what each one does, its
+  // operand, and the line it was read from. the operand of a chord or a
+  // groove is the offset of its run in the notes pool, which starts with
+  // how many notes follow; any other operand is a packed number
+  unsigned char *ops;
+  uint32_t *operands, *notes;
+  int *lines;
+  // the numbers too big to pack
+  struct tunebook_number *numbers;
 };
 
-struct tunebook_voice_command {
-  enum {
-    VOICE_COMMAND_BASE,
-    VOICE_COMMAND_CHORD,
-    VOICE_COMMAND_GROOVE,
-    VOICE_COMMAND_LEGATO,
-    VOICE_COMMAND_MODULATE,
-    VOICE_COMMAND_NOTE,
-    VOICE_COMMAND_REPEAT,
-    VOICE_COMMAND_REST,
-    VOICE_COMMAND_SECTION,
-  } type;
-  union {
-    struct tunebook_number base, note, modulate, repeat, legato;
-    struct tunebook_chord groove, chord;
-  } as;
+enum tunebook_opcode {
+  VOICE_COMMAND_BASE,
+  VOICE_COMMAND_CHORD,
+  VOICE_COMMAND_GROOVE,
+  VOICE_COMMAND_LEGATO,
+  VOICE_COMMAND_MODULATE,
+  VOICE_COMMAND_NOTE,
+  VOICE_COMMAND_REPEAT,
+  VOICE_COMMAND_REST,
+  VOICE_COMMAND_SECTION,
 };
 
+// a number of a score is packed into 32 bits when it fits: the top bit
+// clear, then whether it is exponential, a 14 bit denominator and a 16
+// bit numerator. a bigger one is kept whole in its voice's numbers, and
+// packed as its index there with the top bit set
+#define PACKED_WHOLE 0x80000000u
+#define PACKED_EXPONENTIAL 0x40000000u
+
 struct tunebook_error {
   enum {
     ERROR_EOF,
@@ -163,6 +287,17 @@ struct tunebook_error {
     ERROR_NEED_INSTRUMENT,
     ERROR_NEED_OSCILLATOR,
     ERROR_NEED_SONG,
+    ERROR_INVALID_IMAGE,
+    ERROR_STALE_IMAGE,
+    ERROR_CYCLIC_ROUTE,
+    ERROR_EXPECTED_SHAPE,
+    ERROR_UNKNOWN_LFO,
+    ERROR_NO_CARRIER,
+    ERROR_UNMATCHED_REPEAT,
+    ERROR_TOO_DEEP,
+    ERROR_LIMIT,
+    ERROR_DEADLINE,
+    ERROR_CANCELLED,
   } type;
   struct tunebook_token last_token;
 };
@@ -173,23 +308,149 @@ double number_to_double(double base, struct tunebook_number coeffecient) {
   else return c;
 }
 
+struct tunebook_number unpack_number(const struct tunebook_voice *voice, uint32_t packed) {
+  if (packed & PACKED_WHOLE) return voice->numbers[packed & ~PACKED_WHOLE];
+  return (struct tunebook_number){
+    packed & PACKED_EXPONENTIAL ? NUMBER_EXPONENTIAL : NUMBER_RATIONAL,
+    (int16_t)(packed & 0xffff), packed >> 16 & 0x3fff
+  };
+}
+
+int packed_in_range(const struct tunebook_voice *voice, uint32_t packed) {
+  return !(packed & PACKED_WHOLE) || (packed & ~PACKED_WHOLE) < voice->n_numbers;
+}
+
+uint32_t pack_number
+(struct tunebook_voice *voice, int *s_numbers, struct tunebook_number number) {
+  if (number.numerator >= INT16_MIN && number.numerator <= INT16_MAX
+      && number.denominator >= 0 && number.denominator <= 0x3fff)
+    return (number.type == NUMBER_EXPONENTIAL ? PACKED_EXPONENTIAL : 0)
+      | (uint32_t)number.denominator << 16 | (uint16_t)number.numerator;
+  if (++voice->n_numbers >= *s_numbers) {
+    *s_numbers *= 2;
+    RESIZE(voice->numbers, *s_numbers);
+  }
+  voice->numbers[voice->n_numbers-1] = number;
+  return PACKED_WHOLE | (voice->n_numbers-1);
+}
+
+void push_command
+(struct tunebook_voice *voice, int *s_commands, enum tunebook_opcode op, uint32_t operand,
+ int line) {
+  if (++voice->n_commands >= *s_commands) {
+    *s_commands *= 2;
+    RESIZE(voice->ops, *s_commands);
+    RESIZE(voice->operands, *s_commands);
+    RESIZE(voice->lines, *s_commands);
+  }
+  voice->ops[voice->n_commands-1] = op;
+  voice->operands[voice->n_commands-1] = operand;
+  voice->lines[voice->n_commands-1] = line;
+}
+
+// add to the notes pool of a voice, giving where the value went
+uint32_t push_note(struct tunebook_voice *voice, int *s_notes, uint32_t value) {
+  if (++voice->n_notes >= *s_notes) {
+    *s_notes *= 2;
+    RESIZE(voice->notes, *s_notes);
+  }
+  voice->notes[voice->n_notes-1] = value;
+  return voice->n_notes-1;
+}
+
 void tunebook_print_error(struct tunebook_error error) {
   fprintf(stderr, "uh oh stinky: %i %i\n", error.type, error.last_token.type);
 }
 
+// how much a book may cost, so that books from anyone can be rendered
+// without trusting them; zero is no limit, but sections and includes
+// always nest no deeper than depth, as both are followed by recursion
+#define DEFAULT_MAX_DEPTH 64
+#define MAX_DEPTH 10000
+
+struct tunebook_limits {
+  // the longest any voice may be, in samples, and how many oscillator
+  // evaluations the whole book may take
+  long samples;
+  int64_t evaluations;
+  // the most bytes of sample buffers a song may be rendered in
+  int64_t memory;
+  int depth;
+  // how long a book may take to render, in seconds of wall clock
+  double seconds;
+};
+
+static struct tunebook_limits limits = { 0, 0, 0, DEFAULT_MAX_DEPTH, 0 };
+
+// why the book being worked on should stop, if it should: set through
+// tunebook_cancel by a signal, the deadline's timer, or anything else,
+// and polled while reading, rendering and writing it. whatever does not
+// stop within the grace period after is not waited for
+#define CANCEL_GRACE 5
+
+static atomic_int cancelled = 0;
+
+void tunebook_cancel(int reason) {
+  atomic_store(&cancelled, reason);
+}
+
+void cancel_on_signal(int signal) {
+  struct itimerval grace = { { 0, 0 }, { CANCEL_GRACE, 0 } };
+  if (signal == SIGALRM && atomic_load(&cancelled)) {
+    static const char message[] = "tunebook did not stop in time\n";
+    write(STDERR_FILENO, message, sizeof message - 1);
+    _exit(-1);
+  }
+  tunebook_cancel(signal == SIGALRM ? ERROR_DEADLINE : ERROR_CANCELLED);
+  setitimer(ITIMER_REAL, &grace, NULL);
+}
+
+// start the clock on a book, or with no seconds stop it; a book which
+// ran out of time leaves the next one be
+void arm_deadline(double seconds) {
+  struct itimerval timer = { { 0, 0 }, { seconds, (seconds - (long)seconds) * 1e6 } };
+  int expired = ERROR_DEADLINE;
+  setitimer(ITIMER_REAL, &timer, NULL);
+  if (!seconds) atomic_compare_exchange_strong(&cancelled, &expired, 0);
+}
+
+// where the tokenizer is in the file being read, for the profiler
+static char *source_name = "stdin";
+static int source_line = 1;
+
+// a cancelled book reads as though it ended there
+int next_char(FILE *in) {
+  if (atomic_load(&cancelled)) return EOF;
+  int c = fgetc(in);
+  if (c == '\n') ++source_line;
+  return c;
+}
+
+void unget_char(int c, FILE *in) {
+  if (c == '\n') --source_line;
+  ungetc(c, in);
+}
+
+// why the book was cancelled, if it was, or else the given error
+int cancelled_or(int type) {
+  int reason = atomic_load(&cancelled);
+  return reason ? reason : type;
+}
+
 int tunebook_next_token
 (FILE *in, struct tunebook_token *token, struct tunebook_error *error) {
   int c, n_buffer, s_buffer, sign = 1;
   char *buffer;
  retry:
-  do c = fgetc(in); while (isspace(c));
+  do c = next_char(in); while (isspace(c));
   if (c == EOF) {
-    error->type = ERROR_EOF;
+    error->type = cancelled_or(ERROR_EOF);
     return -1;
   }
+  token->line = source_line;
   switch (c) {
   case '#':
-    do c = fgetc(in); while (c != '\n');
+    do c = next_char(in); while (c != '\n' && c != EOF);
     goto retry;
   case '(':
     token->type = TOKEN_CHORD_START;
@@ -202,8 +463,13 @@ int tunebook_next_token
     s_buffer = 32;
     NEW(buffer, s_buffer);
     for (;;) {
-      c = fgetc(in);
+      c = next_char(in);
       if (c == '"') break;
+      if (c == EOF) {
+        free(buffer);
+        error->type = cancelled_or(ERROR_EXPECTED_STRING);
+        return -1;
+      }
       if (++n_buffer >= s_buffer) {
 	s_buffer *= 2;
 	RESIZE(buffer, s_buffer);
@@ -211,7 +477,7 @@ int tunebook_next_token
       buffer[n_buffer-1] = c;
     }
     buffer[n_buffer] = 0;
-    RESIZE(buffer, n_buffer);
+    RESIZE(buffer, n_buffer + 1);
     token->type = TOKEN_STRING;
     token->as.string = buffer;
     return 0;
@@ -224,7 +490,7 @@ int tunebook_next_token
     token->type = TOKEN_NUMBER;
     token->as.number = (struct tunebook_number){ NUMBER_RATIONAL, c-'0', 1 };
     for (;;) {
-      c = fgetc(in);
+      c = next_char(in);
       if (!isdigit(c)) break;
       token->as.number.numerator *= 10;
       token->as.number.numerator += c-'0';
@@ -234,13 +500,13 @@ int tunebook_next_token
       if (c == '\\') token->as.number.type = NUMBER_EXPONENTIAL;
       token->as.number.denominator = 0;
       for (;;) {
-	c = fgetc(in);
+	c = next_char(in);
 	if (!isdigit(c)) break;
 	token->as.number.denominator *= 10;
 	token->as.number.denominator += c-'0';
       }
     }
-    ungetc(c, in);
+    unget_char(c, in);
     return 0;
   }
   // parse symbol
@@ -249,7 +515,7 @@ int tunebook_next_token
   NEW(buffer, s_buffer);
   buffer[0] = c;
   for (;;) {
-    c = fgetc(in);
+    c = next_char(in);
     if (isspace(c) || c == EOF) break;
     if (++n_buffer >= s_buffer) {
       s_buffer *= 2;
@@ -258,31 +524,46 @@ int tunebook_next_token
     buffer[n_buffer-1] = c;
   }
   buffer[n_buffer] = 0;
-  RESIZE(buffer, n_buffer);
+  RESIZE(buffer, n_buffer + 1);
   if (!strcmp(buffer, "add")) token->type = TOKEN_ADD;
   else if (!strcmp(buffer, "am")) token->type = TOKEN_AM;
   else if (!strcmp(buffer, "attack")) token->type = TOKEN_ATTACK;
+  else if (!strcmp(buffer, "bandpass")) token->type = TOKEN_BANDPASS;
   else if (!strcmp(buffer, "base")) token->type = TOKEN_BASE;
+  else if (!strcmp(buffer, "bus")) token->type = TOKEN_BUS;
+  else if (!strcmp(buffer, "channels")) token->type = TOKEN_CHANNELS;
   else if (!strcmp(buffer, "clip")) token->type = TOKEN_CLIP;
+  else if (!strcmp(buffer, "cutoff")) token->type = TOKEN_CUTOFF;
   else if (!strcmp(buffer, "decay")) token->type = TOKEN_DECAY;
   else if (!strcmp(buffer, "detune")) token->type = TOKEN_DETUNE;
   else if (!strcmp(buffer, "env")) token->type = TOKEN_ENV;
   else if (!strcmp(buffer, "fm")) token->type = TOKEN_FM;
   else if (!strcmp(buffer, "groove")) token->type = TOKEN_GROOVE;
+  else if (!strcmp(buffer, "harmonics")) token->type = TOKEN_HARMONICS;
+  else if (!strcmp(buffer, "highpass")) token->type = TOKEN_HIGHPASS;
   else if (!strcmp(buffer, "hz")) token->type = TOKEN_HZ;
   else if (!strcmp(buffer, "instrument")) token->type = TOKEN_INSTRUMENT;
   else if (!strcmp(buffer, "include")) token->type = TOKEN_INCLUDE;
   else if (!strcmp(buffer, "legato")) token->type = TOKEN_LEGATO;
+  else if (!strcmp(buffer, "lfo")) token->type = TOKEN_LFO;
+  else if (!strcmp(buffer, "loop")) token->type = TOKEN_LOOP;
+  else if (!strcmp(buffer, "lowpass")) token->type = TOKEN_LOWPASS;
   else if (!strcmp(buffer, "modulate")) token->type = TOKEN_MODULATE;
   else if (!strcmp(buffer, "noise")) token->type = TOKEN_NOISE;
+  else if (!strcmp(buffer, "oversample")) token->type = TOKEN_OVERSAMPLE;
+  else if (!strcmp(buffer, "pan")) token->type = TOKEN_PAN;
   else if (!strcmp(buffer, "pm")) token->type = TOKEN_PM;
+  else if (!strcmp(buffer, "polyphony")) token->type = TOKEN_POLYPHONY;
   else if (!strcmp(buffer, "release")) token->type = TOKEN_RELEASE;
   else if (!strcmp(buffer, "repeat")) token->type = TOKEN_REPEAT;
+  else if (!strcmp(buffer, "resonance")) token->type = TOKEN_RESONANCE;
   else if (!strcmp(buffer, "r")) token->type = TOKEN_REST;
   else if (!strcmp(buffer, "rest")) token->type = TOKEN_REST;
+  else if (!strcmp(buffer, "reverb")) token->type = TOKEN_REVERB;
   else if (!strcmp(buffer, "root")) token->type = TOKEN_ROOT;
   else if (!strcmp(buffer, "saw")) token->type = TOKEN_SAW;
   else if (!strcmp(buffer, "section")) token->type = TOKEN_SECTION;
+  else if (!strcmp(buffer, "send")) token->type = TOKEN_SEND;
   else if (!strcmp(buffer, "sin")) token->type = TOKEN_SINE;
   else if (!strcmp(buffer, "sine")) token->type = TOKEN_SINE;
   else if (!strcmp(buffer, "song")) token->type = TOKEN_SONG;
@@ -293,8 +574,10 @@ int tunebook_next_token
   else if (!strcmp(buffer, "tempo")) token->type = TOKEN_TEMPO;
   else if (!strcmp(buffer, "tri")) token->type = TOKEN_TRIANGLE;
   else if (!strcmp(buffer, "triangle")) token->type = TOKEN_TRIANGLE;
+  else if (!strcmp(buffer, "unison")) token->type = TOKEN_UNISON;
   else if (!strcmp(buffer, "voice")) token->type = TOKEN_VOICE;
   else if (!strcmp(buffer, "volume")) token->type = TOKEN_VOLUME;
+  else if (!strcmp(buffer, "wavetable")) token->type = TOKEN_WAVETABLE;
   else {
     error->type = ERROR_UNKNOWN_KEYWORD;
     free(buffer);
@@ -304,19 +587,169 @@ int tunebook_next_token
   return 0;
 }
 
+// in batch mode every included file is parsed once, into a book of its
+// own, and what it defines is copied into each book including it for as
+// long as neither it nor anything it includes has changed on disk
+struct tunebook_include {
+  char *path;
+  struct timespec mtime;
+  struct tunebook_book book;
+  int n_deps;
+  struct tunebook_include **deps, *next;
+};
+
+static int include_cache = 0;
+static struct tunebook_include *includes = NULL, *including = NULL;
+
+int include_fresh(struct tunebook_include *cached) {
+  struct stat st;
+  if (stat(cached->path, &st) || st.st_mtim.tv_sec != cached->mtime.tv_sec
+      || st.st_mtim.tv_nsec != cached->mtime.tv_nsec) return 0;
+  for (int d = 0; d < cached->n_deps; ++d)
+    if (!include_fresh(cached->deps[d])) return 0;
+  return 1;
+}
+
+struct tunebook_include *find_include(const char *path) {
+  for (struct tunebook_include *cached = includes; cached; cached = cached->next)
+    if (!strcmp(cached->path, path) && include_fresh(cached)) return cached;
+  return NULL;
+}
+
+struct tunebook_include *new_include(const char *path, FILE *in) {
+  struct tunebook_include *cached;
+  struct stat st;
+  NEW(cached, 1);
+  cached->path = strdup(path);
+  fstat(fileno(in), &st);
+  cached->mtime = st.st_mtim;
+  cached->book.n_instruments = 0;
+  cached->book.n_songs = 0;
+  NEW(cached->book.instruments, 8);
+  NEW(cached->book.songs, 8);
+  cached->n_deps = 0;
+  cached->deps = NULL;
+  cached->next = NULL;
+  return cached;
+}
+
+// copy what an included file defines into a book; when the book already
+// has an instrument or song of the same name the file has to be read
+// into the book itself, to add to it as it would otherwise
+int merge_include
+(struct tunebook_book *book, struct tunebook_include *cached, int *s_instruments, int *s_songs) {
+  struct tunebook_book *from = &cached->book;
+  for (int i = 0; i < from->n_instruments; ++i)
+    for (int j = 0; j < book->n_instruments; ++j)
+      if (!strcmp(from->instruments[i].name, book->instruments[j].name)) return -1;
+  for (int s = 0; s < from->n_songs; ++s)
+    for (int t = 0; t < book->n_songs; ++t)
+      if (!strcmp(from->songs[s].name, book->songs[t].name)) return -1;
+  for (int i = 0; i < from->n_instruments; ++i) {
+    if (++book->n_instruments >= *s_instruments) {
+      *s_instruments *= 2;
+      RESIZE(book->instruments, *s_instruments);
+    }
+    struct tunebook_instrument *instrument = &book->instruments[book->n_instruments-1];
+    *instrument = from->instruments[i];
+    if (!instrument->origin) instrument->origin = &from->instruments[i];
+  }
+  for (int s = 0; s < from->n_songs; ++s) {
+    if (++book->n_songs >= *s_songs) {
+      *s_songs *= 2;
+      RESIZE(book->songs, *s_songs);
+    }
+    book->songs[book->n_songs-1] = from->songs[s];
+    book->songs[book->n_songs-1].cached = 1;
+  }
+  return 0;
+}
+
+// a copy of n things, which the copy owns
+void *copy_array(const void *from, int n, size_t size) {
+  void *to;
+  if (!from) return NULL;
+  to = malloc(MAX(n, 1) * size);
+  memcpy(to, from, n * size);
+  return to;
+}
+
+// a book adding to a cached instrument or song gets a copy of its own,
+// down to every array it could grow
+void detach_instrument(struct tunebook_instrument *instrument) {
+  struct tunebook_oscillator *oscillators;
+  NEW(oscillators, instrument->n_oscillators);
+  memcpy(oscillators, instrument->oscillators, instrument->n_oscillators * sizeof *oscillators);
+  for (int o = 0; o < instrument->n_oscillators; ++o) {
+    struct tunebook_oscillator *osc = &oscillators[o];
+    osc->am_targets = copy_array(osc->am_targets, osc->n_am_targets, sizeof (char *));
+    osc->fm_targets = copy_array(osc->fm_targets, osc->n_fm_targets, sizeof (char *));
+    osc->pm_targets = copy_array(osc->pm_targets, osc->n_pm_targets, sizeof (char *));
+    osc->add_targets = copy_array(osc->add_targets, osc->n_add_targets, sizeof (char *));
+    osc->sub_targets = copy_array(osc->sub_targets, osc->n_sub_targets, sizeof (char *));
+    osc->env_targets = copy_array(osc->env_targets, osc->n_env_targets, sizeof (char *));
+    osc->cutoff_targets = copy_array(osc->cutoff_targets, osc->n_cutoff_targets, sizeof (char *));
+    osc->partials.notes = copy_array(osc->partials.notes, osc->partials.n_notes,
+                                     sizeof *osc->partials.notes);
+  }
+  instrument->oscillators = oscillators;
+  instrument->linked = 0;
+  instrument->prepared = 0;
+  instrument->kernel = NULL;
+  instrument->origin = NULL;
+}
+
+void detach_song(struct tunebook_song *song) {
+  struct tunebook_voice *voices;
+  struct tunebook_lfo *lfos;
+  NEW(voices, song->n_voices);
+  for (int v = 0; v < song->n_voices; ++v) {
+    struct tunebook_voice *voice = &voices[v];
+    *voice = song->voices[v];
+    NEW(voice->ops, voice->n_commands);
+    NEW(voice->operands, voice->n_commands);
+    NEW(voice->lines, voice->n_commands);
+    NEW(voice->notes, voice->n_notes);
+    NEW(voice->numbers, voice->n_numbers);
+    memcpy(voice->ops, song->voices[v].ops, voice->n_commands * sizeof *voice->ops);
+    memcpy(voice->operands, song->voices[v].operands, voice->n_commands * sizeof *voice->operands);
+    memcpy(voice->lines, song->voices[v].lines, voice->n_commands * sizeof *voice->lines);
+    memcpy(voice->notes, song->voices[v].notes, voice->n_notes * sizeof *voice->notes);
+    memcpy(voice->numbers, song->voices[v].numbers, voice->n_numbers * sizeof *voice->numbers);
+  }
+  NEW(lfos, song->n_lfos);
+  for (int l = 0; l < song->n_lfos; ++l) {
+    lfos[l] = song->lfos[l];
+    lfos[l].n_values = 0;
+    lfos[l].values = NULL;
+  }
+  song->voices = voices;
+  song->lfos = lfos;
+  song->cached = 0;
+}
+
 int tunebook_include_file
 (FILE *in, struct tunebook_book *book, struct tunebook_error *error,
  int *s_instruments, int *s_songs) {
   FILE *included;
+  char *including_name;
   struct tunebook_token token;
-  int shape, i = 0, s_voices = 0, s_oscillators = 0, s_am_targets = 0,
+  int including_line, shape, i = 0, s_voices = 0, s_oscillators = 0, s_am_targets = 0,
     s_fm_targets = 0, s_pm_targets = 0, s_add_targets = 0,
-    s_sub_targets = 0, s_env_targets = 0, s_commands = 0, s_notes = 0;
+    s_sub_targets = 0, s_env_targets = 0, s_cutoff_targets = 0, s_commands = 0,
+    s_notes = 0, s_numbers = 0, s_lfos = 0, line, chord;
   struct tunebook_instrument *instrument = NULL;
   struct tunebook_oscillator *oscillator = NULL;
   struct tunebook_song *song = NULL;
   struct tunebook_voice *voice = NULL;
-  struct tunebook_voice_command *command = NULL;
+  static int include_depth = 0;
+  if (++include_depth > limits.depth) {
+    fprintf(stderr, "%s: includes nest deeper than %i\n", source_name, limits.depth);
+    --include_depth;
+    error->type = ERROR_TOO_DEEP;
+    error->last_token.type = TOKEN_INCLUDE;
+    return -1;
+  }
   for (;;) {
     if (tunebook_next_token(in, &token, error)) goto error;
     switch (token.type) {
@@ -331,8 +764,47 @@ int tunebook_include_file
         error->type = ERROR_FILE_NOT_FOUND;
         goto error;
       }
-      if (tunebook_include_file(included, book, error, s_instruments, s_songs))
+      including_name = source_name;
+      including_line = source_line;
+      source_name = token.as.string;
+      source_line = 1;
+      if (include_cache) {
+        struct tunebook_include *cached = find_include(token.as.string), *parent = including;
+        if (!cached) {
+          int s_cached_instruments = 8, s_cached_songs = 8;
+          cached = new_include(token.as.string, included);
+          including = cached;
+          if (tunebook_include_file(included, &cached->book, error,
+                                    &s_cached_instruments, &s_cached_songs)) {
+            including = parent;
+            fclose(included);
+            goto error;
+          }
+          including = parent;
+          cached->next = includes;
+          includes = cached;
+        }
+        if (parent) {
+          RESIZE(parent->deps, parent->n_deps + 1);
+          parent->deps[parent->n_deps++] = cached;
+        }
+        source_name = including_name;
+        source_line = including_line;
+        if (!merge_include(book, cached, s_instruments, s_songs)) {
+          fclose(included);
+          break;
+        }
+        source_name = token.as.string;
+        source_line = 1;
+        rewind(included);
+      }
+      if (tunebook_include_file(included, book, error, s_instruments, s_songs)) {
+        fclose(included);
         goto error;
+      }
+      fclose(included);
+      source_name = including_name;
+      source_line = including_line;
       break;
     case TOKEN_INSTRUMENT:
       if (tunebook_next_token(in, &token, error)) goto error;
@@ -351,11 +823,17 @@ int tunebook_include_file
         instrument = &book->instruments[book->n_instruments-1];
         s_oscillators = 4;
         instrument->name = token.as.string;
+        instrument->linked = 0;
+        instrument->prepared = 0;
+        instrument->kernel = NULL;
+        instrument->origin = NULL;
+        instrument->oversample = 1;
         instrument->n_oscillators = 0;
         NEW(instrument->oscillators, s_oscillators);
       } else {
         instrument = &book->instruments[i];
-        s_oscillators = instrument->n_oscillators;
+        if (instrument->origin) detach_instrument(instrument);
+        s_oscillators = MAX(1, instrument->n_oscillators);
       }
       break;
     case TOKEN_BASE:
@@ -363,18 +841,14 @@ int tunebook_include_file
         error->type = ERROR_NEED_VOICE;
         goto error;
       }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      command->type = VOICE_COMMAND_BASE;
+      line = token.line;
       if (tunebook_next_token(in, &token, error)) goto error;
       if (token.type != TOKEN_NUMBER) {
 	error->type = ERROR_EXPECTED_NUMBER;
 	goto error;
       }
-      command->as.base = token.as.number;
+      push_command(voice, &s_commands, VOICE_COMMAND_BASE,
+                   pack_number(voice, &s_numbers, token.as.number), line);
       break;
     case TOKEN_SQUARE:
       shape = OSC_SQUARE;
@@ -388,6 +862,15 @@ int tunebook_include_file
     case TOKEN_NOISE:
       shape = OSC_NOISE;
       goto oscillator;
+    case TOKEN_HARMONICS:
+      shape = OSC_HARMONICS;
+      goto oscillator;
+    case TOKEN_WAVETABLE:
+      shape = OSC_WAVETABLE;
+      goto oscillator;
+    case TOKEN_BUS:
+      shape = OSC_BUS;
+      goto oscillator;
     case TOKEN_SINE:
       shape = OSC_SINE;
     oscillator:
@@ -415,6 +898,7 @@ int tunebook_include_file
         s_add_targets = 2;
         s_sub_targets = 2;
         s_env_targets = 2;
+        s_cutoff_targets = 2;
         oscillator->name = token.as.string;
         oscillator->n_am_targets = 0;
         oscillator->n_fm_targets = 0;
@@ -422,12 +906,14 @@ int tunebook_include_file
         oscillator->n_add_targets = 0;
         oscillator->n_sub_targets = 0;
         oscillator->n_env_targets = 0;
+        oscillator->n_cutoff_targets = 0;
         NEW(oscillator->am_targets, s_am_targets);
         NEW(oscillator->fm_targets, s_fm_targets);
         NEW(oscillator->pm_targets, s_pm_targets);
         NEW(oscillator->add_targets, s_add_targets);
         NEW(oscillator->sub_targets, s_sub_targets);
         NEW(oscillator->env_targets, s_env_targets);
+        NEW(oscillator->cutoff_targets, s_cutoff_targets);
         oscillator->shape = shape;
         oscillator->attack = 1.0/32.0;
         oscillator->clip = 0;
@@ -437,15 +923,56 @@ int tunebook_include_file
         oscillator->volume = 1.0/2.0;
         oscillator->hz = 0;
         oscillator->detune = 1;
+        oscillator->filter = FILTER_NONE;
+        oscillator->cutoff = 0;
+        oscillator->resonance = M_SQRT1_2;
+        oscillator->unison = 1;
+        oscillator->spread = 0;
+        oscillator->loop = 0;
       } else {
         oscillator = &instrument->oscillators[i];
         oscillator->shape = shape;
-        s_am_targets = oscillator->n_am_targets;
-        s_fm_targets = oscillator->n_fm_targets;
-        s_pm_targets = oscillator->n_pm_targets;
-        s_add_targets = oscillator->n_add_targets;
-        s_sub_targets = oscillator->n_sub_targets;
-        s_env_targets = oscillator->n_env_targets;
+        s_am_targets = MAX(1, oscillator->n_am_targets);
+        s_fm_targets = MAX(1, oscillator->n_fm_targets);
+        s_pm_targets = MAX(1, oscillator->n_pm_targets);
+        s_add_targets = MAX(1, oscillator->n_add_targets);
+        s_sub_targets = MAX(1, oscillator->n_sub_targets);
+        s_env_targets = MAX(1, oscillator->n_env_targets);
+        s_cutoff_targets = MAX(1, oscillator->n_cutoff_targets);
+      }
+      oscillator->partials.n_notes = 0;
+      oscillator->partials.notes = NULL;
+      oscillator->wavetable = NULL;
+      oscillator->bus = NULL;
+      if (shape == OSC_WAVETABLE || shape == OSC_BUS) {
+        if (tunebook_next_token(in, &token, error)) goto error;
+        if (token.type != TOKEN_STRING) {
+          error->type = ERROR_EXPECTED_STRING;
+          goto error;
+        }
+        if (shape == OSC_BUS) oscillator->bus = token.as.string;
+        else oscillator->wavetable = token.as.string;
+      }
+      if (shape != OSC_HARMONICS) break;
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_CHORD_START) {
+	error->type = ERROR_EXPECTED_CHORD_START;
+	goto error;
+      }
+      s_notes = 4;
+      NEW(oscillator->partials.notes, s_notes);
+      for (;;) {
+	if (tunebook_next_token(in, &token, error)) goto error;
+	if (token.type == TOKEN_CHORD_END) break;
+	if (token.type != TOKEN_NUMBER) {
+	  error->type = ERROR_EXPECTED_NUMBER;
+	  goto error;
+	}
+	if (++oscillator->partials.n_notes >= s_notes) {
+	  s_notes *= 2;
+	  RESIZE(oscillator->partials.notes, s_notes);
+	}
+	oscillator->partials.notes[oscillator->partials.n_notes-1] = token.as.number;
       }
       break;
     case TOKEN_CLIP:
@@ -472,6 +999,43 @@ int tunebook_include_file
       }
       oscillator->detune = number_to_double(1, token.as.number);
       break;
+    case TOKEN_LOOP:
+      if (!oscillator) {
+        error->type = ERROR_NEED_OSCILLATOR;
+        goto error;
+      }
+      oscillator->loop = 1;
+      break;
+    case TOKEN_OVERSAMPLE:
+      if (!instrument) {
+        error->type = ERROR_NEED_INSTRUMENT;
+        goto error;
+      }
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      instrument->oversample = MIN(MAX_OVERSAMPLE, MAX(1, number_to_double(1, token.as.number)));
+      break;
+    case TOKEN_UNISON:
+      if (!oscillator) {
+        error->type = ERROR_NEED_OSCILLATOR;
+        goto error;
+      }
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      oscillator->unison = MIN(MAX_UNISON, MAX(1, number_to_double(1, token.as.number)));
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      oscillator->spread = number_to_double(1, token.as.number);
+      break;
     case TOKEN_ENV:
       if (tunebook_next_token(in, &token, error)) goto error;
       if (token.type != TOKEN_CHORD_START) {
@@ -568,6 +1132,63 @@ int tunebook_include_file
       }
       oscillator->volume = number_to_double(1, token.as.number);
       break;
+    case TOKEN_LOWPASS:
+      shape = FILTER_LOWPASS;
+      goto filter;
+    case TOKEN_HIGHPASS:
+      shape = FILTER_HIGHPASS;
+      goto filter;
+    case TOKEN_BANDPASS:
+      shape = FILTER_BANDPASS;
+    filter:
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      if (!oscillator) {
+        error->type = ERROR_NEED_OSCILLATOR;
+        goto error;
+      }
+      oscillator->filter = shape;
+      oscillator->cutoff = number_to_double(1, token.as.number);
+      break;
+    case TOKEN_RESONANCE:
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      if (!oscillator) {
+        error->type = ERROR_NEED_OSCILLATOR;
+        goto error;
+      }
+      oscillator->resonance = number_to_double(1, token.as.number);
+      break;
+    case TOKEN_CUTOFF:
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_CHORD_START) {
+	error->type = ERROR_EXPECTED_CHORD_START;
+	goto error;
+      }
+      if (!oscillator) {
+        error->type = ERROR_NEED_OSCILLATOR;
+        goto error;
+      }
+      for (;;) {
+	if (tunebook_next_token(in, &token, error)) goto error;
+	if (token.type == TOKEN_CHORD_END) break;
+	if (token.type != TOKEN_STRING) {
+	  error->type = ERROR_EXPECTED_STRING;
+	  goto error;
+	}
+	if (++oscillator->n_cutoff_targets >= s_cutoff_targets) {
+	  s_cutoff_targets *= 2;
+	  RESIZE(oscillator->cutoff_targets, s_cutoff_targets);
+	}
+	oscillator->cutoff_targets[oscillator->n_cutoff_targets-1] = token.as.string;
+      }
+      break;
     case TOKEN_AM:
       if (tunebook_next_token(in, &token, error)) goto error;
       if (token.type != TOKEN_CHORD_START) {
@@ -707,12 +1328,56 @@ int tunebook_include_file
         song->name = token.as.string;
         song->tempo = 60;
         song->root = 440;
+        song->reverb = NULL;
+        song->channels = 1;
+        song->cached = 0;
         song->n_voices = 0;
         NEW(song->voices, s_voices);
+        s_lfos = 2;
+        song->n_lfos = 0;
+        NEW(song->lfos, s_lfos);
       } else {
         song = &book->songs[i];
+        if (song->cached) detach_song(song);
         s_voices = song->n_voices;
+        s_lfos = song->n_lfos;
+      }
+      break;
+    case TOKEN_LFO:
+      if (!song) {
+        error->type = ERROR_NEED_SONG;
+        goto error;
+      }
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_STRING) {
+	error->type = ERROR_EXPECTED_STRING;
+	goto error;
+      }
+      if (song->n_lfos >= s_lfos) {
+        s_lfos = MAX(2, 2 * s_lfos);
+        RESIZE(song->lfos, s_lfos);
+      }
+      struct tunebook_lfo *lfo = &song->lfos[song->n_lfos++];
+      lfo->name = token.as.string;
+      lfo->n_values = 0;
+      lfo->values = NULL;
+      if (tunebook_next_token(in, &token, error)) goto error;
+      switch (token.type) {
+      case TOKEN_SINE: lfo->shape = OSC_SINE; break;
+      case TOKEN_SAW: lfo->shape = OSC_SAW; break;
+      case TOKEN_TRIANGLE: lfo->shape = OSC_TRIANGLE; break;
+      case TOKEN_SQUARE: lfo->shape = OSC_SQUARE; break;
+      case TOKEN_NOISE: lfo->shape = OSC_NOISE; break;
+      default:
+        error->type = ERROR_EXPECTED_SHAPE;
+        goto error;
+      }
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
       }
+      lfo->hz = number_to_double(1, token.as.number);
       break;
     case TOKEN_TEMPO:
       if (tunebook_next_token(in, &token, error)) goto error;
@@ -726,6 +1391,66 @@ int tunebook_include_file
       }
       song->tempo = number_to_double(1, token.as.number);
       break;
+    case TOKEN_REVERB:
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_STRING) {
+	error->type = ERROR_EXPECTED_STRING;
+	goto error;
+      }
+      if (!song) {
+        error->type = ERROR_NEED_SONG;
+        goto error;
+      }
+      song->reverb = token.as.string;
+      break;
+    case TOKEN_SEND:
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      if (!voice) {
+        error->type = ERROR_NEED_VOICE;
+        goto error;
+      }
+      voice->send = number_to_double(1, token.as.number);
+      break;
+    case TOKEN_PAN:
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      if (!voice) {
+        error->type = ERROR_NEED_VOICE;
+        goto error;
+      }
+      voice->pan = MIN(1, MAX(-1, number_to_double(1, token.as.number)));
+      break;
+    case TOKEN_POLYPHONY:
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      if (!voice) {
+        error->type = ERROR_NEED_VOICE;
+        goto error;
+      }
+      voice->polyphony = MAX(0, number_to_double(1, token.as.number));
+      break;
+    case TOKEN_CHANNELS:
+      if (tunebook_next_token(in, &token, error)) goto error;
+      if (token.type != TOKEN_NUMBER) {
+	error->type = ERROR_EXPECTED_NUMBER;
+	goto error;
+      }
+      if (!song) {
+        error->type = ERROR_NEED_SONG;
+        goto error;
+      }
+      song->channels = MIN(MAX_CHANNELS, MAX(1, number_to_double(1, token.as.number)));
+      break;
     case TOKEN_ROOT:
       if (tunebook_next_token(in, &token, error)) goto error;
       if (token.type != TOKEN_NUMBER) {
@@ -754,29 +1479,43 @@ int tunebook_include_file
       }
       voice = &song->voices[song->n_voices-1];
       s_commands = 32;
+      s_notes = 32;
+      s_numbers = 4;
       voice->instrument = token.as.string;
+      voice->source = source_name;
+      voice->send = 0;
+      voice->pan = 0;
+      voice->polyphony = 0;
       voice->n_commands = 0;
-      NEW(voice->commands, s_commands);
+      voice->n_notes = 0;
+      voice->n_numbers = 0;
+      NEW(voice->ops, s_commands);
+      NEW(voice->operands, s_commands);
+      NEW(voice->lines, s_commands);
+      NEW(voice->notes, s_notes);
+      NEW(voice->numbers, s_numbers);
       break;
     case TOKEN_GROOVE:
       if (!voice) {
         error->type = ERROR_NEED_VOICE;
         goto error;
       }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      s_notes = 4;
-      command->type = VOICE_COMMAND_GROOVE;
-      command->as.groove.n_notes = 0;
-      NEW(command->as.groove.notes, s_notes);
+      chord = push_note(voice, &s_notes, 0);
+      push_command(voice, &s_commands, VOICE_COMMAND_GROOVE, chord, token.line);
       if (tunebook_next_token(in, &token, error)) goto error;
       if (token.type != TOKEN_CHORD_START) {
 	error->type = ERROR_EXPECTED_CHORD_START;
 	goto error;
       }
+      goto notes;
+    case TOKEN_CHORD_START:
+      if (!voice) {
+        error->type = ERROR_NEED_VOICE;
+        goto error;
+      }
+      chord = push_note(voice, &s_notes, 0);
+      push_command(voice, &s_commands, VOICE_COMMAND_CHORD, chord, token.line);
+    notes:
       for (;;) {
 	if (tunebook_next_token(in, &token, error)) goto error;
 	if (token.type == TOKEN_CHORD_END) break;
@@ -784,131 +1523,73 @@ int tunebook_include_file
 	  error->type = ERROR_EXPECTED_NUMBER;
 	  goto error;
 	}
-	if (++command->as.groove.n_notes >= s_notes) {
-	  s_notes *= 2;
-	  RESIZE(command->as.groove.notes, s_notes);
-	}
-	command->as.groove.notes[command->as.groove.n_notes-1] = token.as.number;
+	push_note(voice, &s_notes, pack_number(voice, &s_numbers, token.as.number));
+	++voice->notes[chord];
       }
       break;
-    case TOKEN_CHORD_START:
+    case TOKEN_NUMBER:
       if (!voice) {
         error->type = ERROR_NEED_VOICE;
         goto error;
       }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      s_notes = 4;
-      command->type = VOICE_COMMAND_CHORD;
-      command->as.chord.n_notes = 0;
-      NEW(command->as.chord.notes, s_notes);
-      for (;;) {
-	if (tunebook_next_token(in, &token, error)) goto error;
-	if (token.type == TOKEN_CHORD_END) break;
-	if (token.type != TOKEN_NUMBER) {
-	  error->type = ERROR_EXPECTED_NUMBER;
-	  goto error;
-	}
-	if (++command->as.chord.n_notes >= s_notes) {
-	  s_notes *= 2;
-	  RESIZE(command->as.chord.notes, s_notes);
-	}
-	command->as.chord.notes[command->as.chord.n_notes-1] = token.as.number;
-      }
-      break;
-    case TOKEN_NUMBER:
-      if (!voice) {
-        error->type = ERROR_NEED_VOICE;
-        goto error;
-      }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      command->type = VOICE_COMMAND_NOTE;
-      command->as.note = token.as.number;
+      push_command(voice, &s_commands, VOICE_COMMAND_NOTE,
+                   pack_number(voice, &s_numbers, token.as.number), token.line);
       break;
     case TOKEN_SECTION:
       if (!voice) {
         error->type = ERROR_NEED_VOICE;
         goto error;
       }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      command->type = VOICE_COMMAND_SECTION;
+      push_command(voice, &s_commands, VOICE_COMMAND_SECTION, 0, token.line);
       break;
     case TOKEN_REPEAT:
       if (!voice) {
         error->type = ERROR_NEED_VOICE;
         goto error;
       }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      command->type = VOICE_COMMAND_REPEAT;
+      line = token.line;
       if (tunebook_next_token(in, &token, error)) goto error;
       if (token.type != TOKEN_NUMBER) {
 	error->type = ERROR_EXPECTED_NUMBER;
 	goto error;
       }
-      command->as.repeat = token.as.number;
+      push_command(voice, &s_commands, VOICE_COMMAND_REPEAT,
+                   pack_number(voice, &s_numbers, token.as.number), line);
       break;
     case TOKEN_REST:
       if (!voice) {
         error->type = ERROR_NEED_VOICE;
         goto error;
       }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      command->type = VOICE_COMMAND_REST;
+      push_command(voice, &s_commands, VOICE_COMMAND_REST, 0, token.line);
       break;
     case TOKEN_LEGATO:
       if (!voice) {
         error->type = ERROR_NEED_VOICE;
         goto error;
       }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      command->type = VOICE_COMMAND_LEGATO;
+      line = token.line;
       if (tunebook_next_token(in, &token, error)) goto error;
       if (token.type != TOKEN_NUMBER) {
 	error->type = ERROR_EXPECTED_NUMBER;
 	goto error;
       }
-      command->as.legato = token.as.number;
+      push_command(voice, &s_commands, VOICE_COMMAND_LEGATO,
+                   pack_number(voice, &s_numbers, token.as.number), line);
       break;
     case TOKEN_MODULATE:
       if (!voice) {
         error->type = ERROR_NEED_VOICE;
         goto error;
       }
-      if (++voice->n_commands >= s_commands) {
-	s_commands *= 2;
-	RESIZE(voice->commands, s_commands);
-      }
-      command = &voice->commands[voice->n_commands-1];
-      command->type = VOICE_COMMAND_MODULATE;
+      line = token.line;
       if (tunebook_next_token(in, &token, error)) goto error;
       if (token.type != TOKEN_NUMBER) {
 	error->type = ERROR_EXPECTED_NUMBER;
 	goto error;
       }
-      command->as.modulate = token.as.number;
+      push_command(voice, &s_commands, VOICE_COMMAND_MODULATE,
+                   pack_number(voice, &s_numbers, token.as.number), line);
       break;
     default:
       error->type = ERROR_UNIMPLEMENTED;
@@ -918,7 +1599,9 @@ int tunebook_include_file
   }
   RESIZE(book->instruments, book->n_instruments);
   RESIZE(book->songs, book->n_songs);
+  // what was merged from the include cache still belongs to it
   for (int i = 0; i < book->n_instruments; ++i) {
+    if (book->instruments[i].origin) continue;
     RESIZE(book->instruments[i].oscillators, book->instruments[i].n_oscillators);
     for (int o = 0; o < book->instruments[i].n_oscillators; ++o) {
       RESIZE(book->instruments[i].oscillators[o].am_targets,
@@ -934,28 +1617,21 @@ int tunebook_include_file
     }
   }
   for (int s = 0; s < book->n_songs; ++s) {
+    if (book->songs[s].cached) continue;
     RESIZE(book->songs[s].voices, book->songs[s].n_voices);
     for (int v = 0; v < book->songs[s].n_voices; ++v) {
-      RESIZE(book->songs[s].voices[v].commands,
-	     book->songs[s].voices[v].n_commands);
-      for (int c = 0; c < book->songs[s].voices[v].n_commands; ++c) {
-	switch (book->songs[s].voices[v].commands[c].type) {
-	case VOICE_COMMAND_GROOVE:
-	  RESIZE(book->songs[s].voices[v].commands[c].as.groove.notes,
-		 book->songs[s].voices[v].commands[c].as.groove.n_notes);
-	  break;
-	case VOICE_COMMAND_CHORD:
-	  RESIZE(book->songs[s].voices[v].commands[c].as.chord.notes,
-		 book->songs[s].voices[v].commands[c].as.chord.n_notes);
-	  break;
-	default:
-	  break;
-	}
-      }
+      struct tunebook_voice *voice = &book->songs[s].voices[v];
+      RESIZE(voice->ops, voice->n_commands);
+      RESIZE(voice->operands, voice->n_commands);
+      RESIZE(voice->lines, voice->n_commands);
+      RESIZE(voice->notes, voice->n_notes);
+      RESIZE(voice->numbers, voice->n_numbers);
     }
   }
+  --include_depth;
   return 0;
  error:
+  --include_depth;
   error->last_token = token;
   if (error->type == ERROR_EOF) return 0;
   return -1;
@@ -972,277 +1648,3890 @@ int tunebook_read_file
   return tunebook_include_file(in, book, error, &s_instruments, &s_songs);
 }
 
+void link_targets
+(struct tunebook_instrument *instrument, int source, int kind,
+ int n_targets, char **targets, int *s_routes) {
+  struct tunebook_route *route;
+  for (int j = 0; j < n_targets; ++j) {
+    for (int o = 0; o < instrument->n_oscillators; ++o) {
+      if (o == source) continue;
+      if (strcmp(targets[j], instrument->oscillators[o].name)) continue;
+      struct tunebook_oscillator *target = &instrument->oscillators[o];
+      if (++target->n_routes >= s_routes[o]) {
+        s_routes[o] *= 2;
+        RESIZE(target->routes, s_routes[o]);
+      }
+      route = &target->routes[target->n_routes-1];
+      route->kind = kind;
+      route->source = source;
+    }
+  }
+}
+
+// resolve an instrument's targets to routes; this is left until the
+// instrument is first rendered, so unused instruments cost nothing
+void tunebook_link_instrument(struct tunebook_instrument *instrument) {
+  int *s_routes;
+  if (instrument->linked) return;
+  NEW(s_routes, instrument->n_oscillators);
+  for (int o = 0; o < instrument->n_oscillators; ++o) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[o];
+    osc->modulator = osc->n_am_targets
+      + osc->n_fm_targets
+      + osc->n_pm_targets
+      + osc->n_add_targets
+      + osc->n_sub_targets
+      + osc->n_env_targets
+      + osc->n_cutoff_targets;
+    s_routes[o] = 2;
+    osc->n_routes = 0;
+    NEW(osc->routes, s_routes[o]);
+  }
+  for (int o = 0; o < instrument->n_oscillators; ++o) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[o];
+    link_targets(instrument, o, ROUTE_AM, osc->n_am_targets, osc->am_targets, s_routes);
+    link_targets(instrument, o, ROUTE_FM, osc->n_fm_targets, osc->fm_targets, s_routes);
+    link_targets(instrument, o, ROUTE_PM, osc->n_pm_targets, osc->pm_targets, s_routes);
+    link_targets(instrument, o, ROUTE_ADD, osc->n_add_targets, osc->add_targets, s_routes);
+    link_targets(instrument, o, ROUTE_SUB, osc->n_sub_targets, osc->sub_targets, s_routes);
+    link_targets(instrument, o, ROUTE_ENV, osc->n_env_targets, osc->env_targets, s_routes);
+    link_targets(instrument, o, ROUTE_CUTOFF, osc->n_cutoff_targets, osc->cutoff_targets, s_routes);
+  }
+  free(s_routes);
+  instrument->linked = 1;
+}
+
+// resolve every name reference in the book to an index, so that the
+// renderer never has to compare strings
+int tunebook_link_book
+(struct tunebook_book *book, struct tunebook_error *error) {
+  for (int s = 0; s < book->n_songs; ++s) {
+    for (int v = 0; v < book->songs[s].n_voices; ++v) {
+      struct tunebook_voice *voice = &book->songs[s].voices[v];
+      if ((error->type = atomic_load(&cancelled))) return -1;
+      for (voice->instrument_i = 0; voice->instrument_i < book->n_instruments; ++voice->instrument_i) {
+        if (!strcmp(voice->instrument, book->instruments[voice->instrument_i].name)) break;
+      }
+      if (voice->instrument_i == book->n_instruments) {
+        error->type = ERROR_UNKNOWN_INSTRUMENT;
+        error->last_token.type = TOKEN_STRING;
+        error->last_token.as.string = voice->instrument;
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+// precompiled books are a single relocatable image: a header followed by
+// flat tables which refer to each other by index, never by pointer, so
+// that a loaded image can be rendered straight out of the mapping
+#define IMAGE_MAGIC "tunebook"
+#define IMAGE_VERSION 12
+#define IMAGE_NONE UINT32_MAX
+#define IMAGE_BYTE_ORDER 0x01020304
+#define IMAGE_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
+enum {
+  IMAGE_INSTRUMENTS,
+  IMAGE_OSCILLATORS,
+  IMAGE_ROUTES,
+  IMAGE_SONGS,
+  IMAGE_LFOS,
+  IMAGE_VOICES,
+  IMAGE_OPS,
+  IMAGE_OPERANDS,
+  IMAGE_LINES,
+  IMAGE_POOL,
+  IMAGE_NOTES,
+  IMAGE_STRINGS,
+  N_IMAGE_TABLES,
+};
+
+struct tunebook_image_header {
+  char magic[8];
+  uint32_t version, byte_order;
+  uint64_t checksum;
+  uint32_t count[N_IMAGE_TABLES];
+};
+
+struct tunebook_image_instrument {
+  uint32_t name, oscillator, n_oscillators, oversample;
+};
+
+struct tunebook_image_oscillator {
+  double attack, decay, sustain, release, volume, hz, detune, clip, cutoff, resonance, spread;
+  uint32_t name, shape, modulator, route, n_routes, filter, partial, n_partials, unison,
+    wavetable, loop, bus;
+};
+
+struct tunebook_image_song {
+  double tempo, root;
+  uint32_t name, voice, n_voices, reverb, lfo, n_lfos, channels, pad;
+};
+
+struct tunebook_image_lfo {
+  double hz;
+  uint32_t name, shape;
+};
+
+// a voice's commands are stored as they are packed in memory, in the
+// ops, operands, lines and pool tables; the numbers too big to pack are
+// kept with the notes
+struct tunebook_image_voice {
+  double send, pan;
+  uint32_t instrument, command, n_commands, pool, n_pool, number, n_numbers, source,
+    polyphony, pad;
+};
+
+static const size_t image_record_size[N_IMAGE_TABLES] = {
+  sizeof(struct tunebook_image_instrument),
+  sizeof(struct tunebook_image_oscillator),
+  sizeof(struct tunebook_route),
+  sizeof(struct tunebook_image_song),
+  sizeof(struct tunebook_image_lfo),
+  sizeof(struct tunebook_image_voice),
+  1,
+  sizeof(uint32_t),
+  sizeof(int),
+  sizeof(uint32_t),
+  sizeof(struct tunebook_number),
+  1,
+};
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+  const unsigned char *bytes = data;
+  while (size--) {
+    hash ^= *bytes++;
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+size_t image_layout(struct tunebook_image_header *header, size_t *offset) {
+  size_t size = IMAGE_ALIGN(sizeof *header);
+  for (int t = 0; t < N_IMAGE_TABLES; ++t) {
+    offset[t] = size;
+    size += IMAGE_ALIGN(header->count[t] * image_record_size[t]);
+  }
+  return size;
+}
+
+uint64_t image_checksum(const char *image, size_t size) {
+  struct tunebook_image_header header;
+  memcpy(&header, image, sizeof header);
+  header.checksum = 0;
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, &header, sizeof header);
+  return fnv1a(hash, image + sizeof header, size - sizeof header);
+}
+
+uint32_t image_string(char *strings, uint32_t *n_strings, const char *string) {
+  uint32_t at = *n_strings;
+  strcpy(strings + at, string);
+  *n_strings += strlen(string) + 1;
+  return at;
+}
+
+int tunebook_compile_book
+(struct tunebook_book *book, FILE *out, struct tunebook_error *error) {
+  struct tunebook_image_header header = { IMAGE_MAGIC, IMAGE_VERSION, IMAGE_BYTE_ORDER };
+  size_t offset[N_IMAGE_TABLES];
+  uint32_t n[N_IMAGE_TABLES] = { 0 };
+  header.count[IMAGE_INSTRUMENTS] = book->n_instruments;
+  header.count[IMAGE_SONGS] = book->n_songs;
+  for (int i = 0; i < book->n_instruments; ++i) {
+    struct tunebook_instrument *instrument = &book->instruments[i];
+    tunebook_link_instrument(instrument);
+    header.count[IMAGE_STRINGS] += strlen(instrument->name) + 1;
+    header.count[IMAGE_OSCILLATORS] += instrument->n_oscillators;
+    for (int o = 0; o < instrument->n_oscillators; ++o) {
+      header.count[IMAGE_STRINGS] += strlen(instrument->oscillators[o].name) + 1;
+      header.count[IMAGE_ROUTES] += instrument->oscillators[o].n_routes;
+      header.count[IMAGE_NOTES] += instrument->oscillators[o].partials.n_notes;
+      if (instrument->oscillators[o].wavetable)
+        header.count[IMAGE_STRINGS] += strlen(instrument->oscillators[o].wavetable) + 1;
+      if (instrument->oscillators[o].bus)
+        header.count[IMAGE_STRINGS] += strlen(instrument->oscillators[o].bus) + 1;
+    }
+  }
+  for (int s = 0; s < book->n_songs; ++s) {
+    struct tunebook_song *song = &book->songs[s];
+    header.count[IMAGE_STRINGS] += strlen(song->name) + 1;
+    if (song->reverb) header.count[IMAGE_STRINGS] += strlen(song->reverb) + 1;
+    header.count[IMAGE_LFOS] += song->n_lfos;
+    for (int l = 0; l < song->n_lfos; ++l)
+      header.count[IMAGE_STRINGS] += strlen(song->lfos[l].name) + 1;
+    header.count[IMAGE_VOICES] += song->n_voices;
+    for (int v = 0; v < song->n_voices; ++v) {
+      header.count[IMAGE_STRINGS] += strlen(song->voices[v].source) + 1;
+      header.count[IMAGE_OPS] += song->voices[v].n_commands;
+      header.count[IMAGE_OPERANDS] += song->voices[v].n_commands;
+      header.count[IMAGE_LINES] += song->voices[v].n_commands;
+      header.count[IMAGE_POOL] += song->voices[v].n_notes;
+      header.count[IMAGE_NOTES] += song->voices[v].n_numbers;
+    }
+  }
+  size_t size = image_layout(&header, offset);
+  char *image = calloc(1, size);
+  struct tunebook_image_instrument *instruments = (void *)(image + offset[IMAGE_INSTRUMENTS]);
+  struct tunebook_image_oscillator *oscillators = (void *)(image + offset[IMAGE_OSCILLATORS]);
+  struct tunebook_route *routes = (void *)(image + offset[IMAGE_ROUTES]);
+  struct tunebook_image_song *songs = (void *)(image + offset[IMAGE_SONGS]);
+  struct tunebook_image_lfo *lfos = (void *)(image + offset[IMAGE_LFOS]);
+  struct tunebook_image_voice *voices = (void *)(image + offset[IMAGE_VOICES]);
+  unsigned char *ops = (void *)(image + offset[IMAGE_OPS]);
+  uint32_t *operands = (void *)(image + offset[IMAGE_OPERANDS]);
+  int *lines = (void *)(image + offset[IMAGE_LINES]);
+  uint32_t *pool = (void *)(image + offset[IMAGE_POOL]);
+  struct tunebook_number *notes = (void *)(image + offset[IMAGE_NOTES]);
+  char *strings = image + offset[IMAGE_STRINGS];
+  for (int i = 0; i < book->n_instruments; ++i) {
+    struct tunebook_instrument *instrument = &book->instruments[i];
+    instruments[i].name = image_string(strings, &n[IMAGE_STRINGS], instrument->name);
+    instruments[i].oscillator = n[IMAGE_OSCILLATORS];
+    instruments[i].n_oscillators = instrument->n_oscillators;
+    instruments[i].oversample = instrument->oversample;
+    for (int o = 0; o < instrument->n_oscillators; ++o) {
+      struct tunebook_oscillator *osc = &instrument->oscillators[o];
+      struct tunebook_image_oscillator *record = &oscillators[n[IMAGE_OSCILLATORS]++];
+      record->attack = osc->attack;
+      record->decay = osc->decay;
+      record->sustain = osc->sustain;
+      record->release = osc->release;
+      record->volume = osc->volume;
+      record->hz = osc->hz;
+      record->detune = osc->detune;
+      record->clip = osc->clip;
+      record->cutoff = osc->cutoff;
+      record->resonance = osc->resonance;
+      record->filter = osc->filter;
+      record->unison = osc->unison;
+      record->wavetable = osc->wavetable
+        ? image_string(strings, &n[IMAGE_STRINGS], osc->wavetable) : IMAGE_NONE;
+      record->loop = osc->loop;
+      record->bus = osc->bus ? image_string(strings, &n[IMAGE_STRINGS], osc->bus) : IMAGE_NONE;
+      record->spread = osc->spread;
+      record->name = image_string(strings, &n[IMAGE_STRINGS], osc->name);
+      record->shape = osc->shape;
+      record->modulator = osc->modulator;
+      record->route = n[IMAGE_ROUTES];
+      record->n_routes = osc->n_routes;
+      memcpy(&routes[n[IMAGE_ROUTES]], osc->routes, osc->n_routes * sizeof *routes);
+      n[IMAGE_ROUTES] += osc->n_routes;
+      record->partial = n[IMAGE_NOTES];
+      record->n_partials = osc->partials.n_notes;
+      memcpy(&notes[n[IMAGE_NOTES]], osc->partials.notes, osc->partials.n_notes * sizeof *notes);
+      n[IMAGE_NOTES] += osc->partials.n_notes;
+    }
+  }
+  for (int s = 0; s < book->n_songs; ++s) {
+    struct tunebook_song *song = &book->songs[s];
+    songs[s].tempo = song->tempo;
+    songs[s].root = song->root;
+    songs[s].channels = song->channels;
+    songs[s].name = image_string(strings, &n[IMAGE_STRINGS], song->name);
+    songs[s].voice = n[IMAGE_VOICES];
+    songs[s].n_voices = song->n_voices;
+    songs[s].reverb = song->reverb
+      ? image_string(strings, &n[IMAGE_STRINGS], song->reverb) : IMAGE_NONE;
+    songs[s].lfo = n[IMAGE_LFOS];
+    songs[s].n_lfos = song->n_lfos;
+    for (int l = 0; l < song->n_lfos; ++l) {
+      struct tunebook_image_lfo *record = &lfos[n[IMAGE_LFOS]++];
+      record->hz = song->lfos[l].hz;
+      record->name = image_string(strings, &n[IMAGE_STRINGS], song->lfos[l].name);
+      record->shape = song->lfos[l].shape;
+    }
+    for (int v = 0; v < song->n_voices; ++v) {
+      struct tunebook_voice *voice = &song->voices[v];
+      struct tunebook_image_voice *record = &voices[n[IMAGE_VOICES]++];
+      record->send = voice->send;
+      record->pan = voice->pan;
+      record->polyphony = voice->polyphony;
+      record->instrument = voice->instrument_i;
+      record->command = n[IMAGE_OPS];
+      record->n_commands = voice->n_commands;
+      record->pool = n[IMAGE_POOL];
+      record->n_pool = voice->n_notes;
+      record->number = n[IMAGE_NOTES];
+      record->n_numbers = voice->n_numbers;
+      record->source = image_string(strings, &n[IMAGE_STRINGS], voice->source);
+      memcpy(&ops[n[IMAGE_OPS]], voice->ops, voice->n_commands * sizeof *ops);
+      memcpy(&operands[n[IMAGE_OPS]], voice->operands, voice->n_commands * sizeof *operands);
+      memcpy(&lines[n[IMAGE_OPS]], voice->lines, voice->n_commands * sizeof *lines);
+      n[IMAGE_OPS] += voice->n_commands;
+      memcpy(&pool[n[IMAGE_POOL]], voice->notes, voice->n_notes * sizeof *pool);
+      n[IMAGE_POOL] += voice->n_notes;
+      memcpy(&notes[n[IMAGE_NOTES]], voice->numbers, voice->n_numbers * sizeof *notes);
+      n[IMAGE_NOTES] += voice->n_numbers;
+    }
+  }
+  memcpy(image, &header, sizeof header);
+  header.checksum = image_checksum(image, size);
+  memcpy(image, &header, sizeof header);
+  int written = fwrite(image, size, 1, out);
+  free(image);
+  if (written != 1) {
+    error->type = ERROR_FILE_NOT_FOUND;
+    return -1;
+  }
+  return 0;
+}
+
+// map a compiled book into memory; names, routes, notes and the packed
+// commands are used in place, and everything else is built in one
+// allocation
+int tunebook_load_image
+(const char *path, struct tunebook_book *book, struct tunebook_error *error) {
+  struct tunebook_image_header header;
+  struct stat st;
+  size_t offset[N_IMAGE_TABLES];
+  char *image, *arena;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    error->type = ERROR_FILE_NOT_FOUND;
+    return -1;
+  }
+  if (fstat(fd, &st) || st.st_size < sizeof header) {
+    close(fd);
+    error->type = ERROR_INVALID_IMAGE;
+    return -1;
+  }
+  image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    error->type = ERROR_INVALID_IMAGE;
+    return -1;
+  }
+  memcpy(&header, image, sizeof header);
+  error->type = ERROR_INVALID_IMAGE;
+  if (memcmp(header.magic, IMAGE_MAGIC, sizeof header.magic)) goto error;
+  if (header.byte_order != IMAGE_BYTE_ORDER) goto error;
+  if (header.version != IMAGE_VERSION) {
+    error->type = ERROR_STALE_IMAGE;
+    goto error;
+  }
+  if (image_layout(&header, offset) != st.st_size) goto error;
+  if (header.checksum != image_checksum(image, st.st_size)) goto error;
+  struct tunebook_image_instrument *instruments = (void *)(image + offset[IMAGE_INSTRUMENTS]);
+  struct tunebook_image_oscillator *oscillators = (void *)(image + offset[IMAGE_OSCILLATORS]);
+  struct tunebook_route *routes = (void *)(image + offset[IMAGE_ROUTES]);
+  struct tunebook_image_song *songs = (void *)(image + offset[IMAGE_SONGS]);
+  struct tunebook_image_lfo *lfos = (void *)(image + offset[IMAGE_LFOS]);
+  struct tunebook_image_voice *voices = (void *)(image + offset[IMAGE_VOICES]);
+  unsigned char *ops = (void *)(image + offset[IMAGE_OPS]);
+  uint32_t *operands = (void *)(image + offset[IMAGE_OPERANDS]);
+  int *lines = (void *)(image + offset[IMAGE_LINES]);
+  uint32_t *pool = (void *)(image + offset[IMAGE_POOL]);
+  struct tunebook_number *notes = (void *)(image + offset[IMAGE_NOTES]);
+  char *strings = image + offset[IMAGE_STRINGS];
+  uint32_t *count = header.count;
+  if (count[IMAGE_STRINGS] && strings[count[IMAGE_STRINGS]-1]) goto error;
+  arena = malloc(count[IMAGE_INSTRUMENTS] * sizeof *book->instruments
+                 + count[IMAGE_OSCILLATORS] * sizeof *book->instruments->oscillators
+                 + count[IMAGE_SONGS] * sizeof *book->songs
+                 + count[IMAGE_LFOS] * sizeof *book->songs->lfos
+                 + count[IMAGE_VOICES] * sizeof *book->songs->voices);
+  book->n_instruments = count[IMAGE_INSTRUMENTS];
+  book->instruments = (void *)arena;
+  struct tunebook_oscillator *oscillator = (void *)(book->instruments + count[IMAGE_INSTRUMENTS]);
+  book->n_songs = count[IMAGE_SONGS];
+  book->songs = (void *)(oscillator + count[IMAGE_OSCILLATORS]);
+  struct tunebook_lfo *lfo = (void *)(book->songs + count[IMAGE_SONGS]);
+  struct tunebook_voice *voice = (void *)(lfo + count[IMAGE_LFOS]);
+  if (count[IMAGE_OPS] != count[IMAGE_OPERANDS] || count[IMAGE_OPS] != count[IMAGE_LINES])
+    goto invalid;
+  for (int i = 0; i < book->n_instruments; ++i) {
+    struct tunebook_instrument *instrument = &book->instruments[i];
+    if (instruments[i].name >= count[IMAGE_STRINGS]) goto invalid;
+    if (instruments[i].oscillator + (uint64_t)instruments[i].n_oscillators > count[IMAGE_OSCILLATORS])
+      goto invalid;
+    if (instruments[i].oversample < 1 || instruments[i].oversample > MAX_OVERSAMPLE) goto invalid;
+    instrument->linked = 1;
+    instrument->prepared = 0;
+    instrument->kernel = NULL;
+    instrument->origin = NULL;
+    instrument->name = strings + instruments[i].name;
+    instrument->n_oscillators = instruments[i].n_oscillators;
+    instrument->oversample = instruments[i].oversample;
+    instrument->oscillators = oscillator + instruments[i].oscillator;
+    for (int o = 0; o < instrument->n_oscillators; ++o) {
+      struct tunebook_image_oscillator *record = &oscillators[instruments[i].oscillator + o];
+      struct tunebook_oscillator *osc = &instrument->oscillators[o];
+      if (record->name >= count[IMAGE_STRINGS]) goto invalid;
+      if (record->route + (uint64_t)record->n_routes > count[IMAGE_ROUTES]) goto invalid;
+      if (record->filter > FILTER_BANDPASS || record->shape > OSC_BUS) goto invalid;
+      if (record->wavetable != IMAGE_NONE && record->wavetable >= count[IMAGE_STRINGS]) goto invalid;
+      if (record->bus != IMAGE_NONE && record->bus >= count[IMAGE_STRINGS]) goto invalid;
+      if ((record->shape == OSC_BUS) != (record->bus != IMAGE_NONE)) goto invalid;
+      if (record->partial + (uint64_t)record->n_partials > count[IMAGE_NOTES]) goto invalid;
+      // the checksum only catches accidents, so a route could point anywhere
+      for (int r = 0; r < record->n_routes; ++r)
+        if ((unsigned)routes[record->route + r].source >= (unsigned)instrument->n_oscillators
+            || (unsigned)routes[record->route + r].kind > ROUTE_CUTOFF) goto invalid;
+      memset(osc, 0, sizeof *osc);
+      osc->name = strings + record->name;
+      osc->shape = record->shape;
+      osc->attack = record->attack;
+      osc->decay = record->decay;
+      osc->sustain = record->sustain;
+      osc->release = record->release;
+      osc->volume = record->volume;
+      osc->hz = record->hz;
+      osc->detune = record->detune;
+      osc->clip = record->clip;
+      osc->filter = record->filter;
+      osc->unison = MIN(MAX_UNISON, MAX(1, record->unison));
+      osc->spread = record->spread;
+      osc->wavetable = record->wavetable == IMAGE_NONE ? NULL : strings + record->wavetable;
+      osc->loop = record->loop;
+      osc->bus = record->bus == IMAGE_NONE ? NULL : strings + record->bus;
+      osc->partials.n_notes = record->n_partials;
+      osc->partials.notes = notes + record->partial;
+      osc->cutoff = record->cutoff;
+      osc->resonance = record->resonance;
+      osc->modulator = record->modulator;
+      osc->n_routes = record->n_routes;
+      osc->routes = routes + record->route;
+    }
+  }
+  for (int s = 0; s < book->n_songs; ++s) {
+    struct tunebook_song *song = &book->songs[s];
+    if (songs[s].name >= count[IMAGE_STRINGS]) goto invalid;
+    if (songs[s].voice + (uint64_t)songs[s].n_voices > count[IMAGE_VOICES]) goto invalid;
+    if (songs[s].reverb != IMAGE_NONE && songs[s].reverb >= count[IMAGE_STRINGS]) goto invalid;
+    if (songs[s].lfo + (uint64_t)songs[s].n_lfos > count[IMAGE_LFOS]) goto invalid;
+    if (songs[s].channels < 1 || songs[s].channels > MAX_CHANNELS) goto invalid;
+    song->name = strings + songs[s].name;
+    song->tempo = songs[s].tempo;
+    song->root = songs[s].root;
+    song->channels = songs[s].channels;
+    song->reverb = songs[s].reverb == IMAGE_NONE ? NULL : strings + songs[s].reverb;
+    song->cached = 0;
+    song->n_voices = songs[s].n_voices;
+    song->voices = voice + songs[s].voice;
+    song->n_lfos = songs[s].n_lfos;
+    song->lfos = lfo + songs[s].lfo;
+    for (int l = 0; l < song->n_lfos; ++l) {
+      struct tunebook_image_lfo *record = &lfos[songs[s].lfo + l];
+      if (record->name >= count[IMAGE_STRINGS] || record->shape > OSC_NOISE) goto invalid;
+      song->lfos[l].name = strings + record->name;
+      song->lfos[l].shape = record->shape;
+      song->lfos[l].hz = record->hz;
+      song->lfos[l].n_values = 0;
+      song->lfos[l].values = NULL;
+    }
+    for (int v = 0; v < song->n_voices; ++v) {
+      struct tunebook_image_voice *record = &voices[songs[s].voice + v];
+      if (record->instrument >= book->n_instruments) goto invalid;
+      if (record->source >= count[IMAGE_STRINGS]) goto invalid;
+      if (record->command + (uint64_t)record->n_commands > count[IMAGE_OPS]) goto invalid;
+      if (record->pool + (uint64_t)record->n_pool > count[IMAGE_POOL]) goto invalid;
+      if (record->number + (uint64_t)record->n_numbers > count[IMAGE_NOTES]) goto invalid;
+      struct tunebook_voice *loaded = &song->voices[v];
+      loaded->instrument_i = record->instrument;
+      loaded->instrument = book->instruments[record->instrument].name;
+      loaded->source = strings + record->source;
+      loaded->send = record->send;
+      loaded->pan = record->pan;
+      loaded->polyphony = record->polyphony;
+      loaded->n_commands = record->n_commands;
+      loaded->ops = ops + record->command;
+      loaded->operands = operands + record->command;
+      loaded->lines = lines + record->command;
+      loaded->n_notes = record->n_pool;
+      loaded->notes = pool + record->pool;
+      loaded->n_numbers = record->n_numbers;
+      loaded->numbers = notes + record->number;
+      for (int c = 0; c < loaded->n_commands; ++c) {
+        uint32_t operand = loaded->operands[c];
+        switch (loaded->ops[c]) {
+        case VOICE_COMMAND_CHORD:
+        case VOICE_COMMAND_GROOVE:
+          if (operand >= loaded->n_notes
+              || operand + 1 + (uint64_t)loaded->notes[operand] > loaded->n_notes) goto invalid;
+          for (uint32_t k = 1; k <= loaded->notes[operand]; ++k)
+            if (!packed_in_range(loaded, loaded->notes[operand + k])) goto invalid;
+          break;
+        case VOICE_COMMAND_REST:
+        case VOICE_COMMAND_SECTION:
+          break;
+        case VOICE_COMMAND_BASE:
+        case VOICE_COMMAND_LEGATO:
+        case VOICE_COMMAND_MODULATE:
+        case VOICE_COMMAND_NOTE:
+        case VOICE_COMMAND_REPEAT:
+          if (!packed_in_range(loaded, operand)) goto invalid;
+          break;
+        default:
+          goto invalid;
+        }
+      }
+    }
+  }
+  return 0;
+ invalid:
+  free(arena);
+ error:
+  munmap(image, st.st_size);
+  return -1;
+}
+
 int is_modulator(struct tunebook_instrument *instrument, int o) {
-  struct tunebook_oscillator *osc = &instrument->oscillators[o];
-  return osc->n_am_targets
-    + osc->n_fm_targets
-    + osc->n_pm_targets
-    + osc->n_add_targets
-    + osc->n_sub_targets
-    + osc->n_env_targets;
+  return instrument->oscillators[o].modulator;
 }
 
-double amp_at_point
-(int point, int beat_length, double freq,
- struct tunebook_instrument *instrument, int osc_i) {
-  osc_fun wave_func = sin;
-  struct tunebook_oscillator *osc = &instrument->oscillators[osc_i];
-  int n_env = 0;
+// slow-moving parameters are evaluated once per control period and
+// linearly interpolated between, rather than on every sample
+#define CONTROL_RATE 1500
+#define MAX_CONTROL_STEP 0.05
+
+static int control_period = SAMPLE_RATE / CONTROL_RATE;
+
+// the notes of a chord which fall to the same carrier are rendered
+// together, up to this many at once, each in a lane of its own which
+// shares the instrument's envelopes and routing with the others
+#define CHORD_LANES 8
+
+// the profiler attributes synthesis time and oscillator evaluations to
+// source lines, instruments, oscillators and whole call stacks, each
+// kept in a table keyed by a string
+#define PROFILE_TOP 10
+
+struct tunebook_profile_entry {
+  char *key;
+  long plays;
+  int64_t evaluations;
+  double seconds;
+};
+
+struct tunebook_profile_table {
+  int n_entries, s_entries;
+  struct tunebook_profile_entry *entries;
+};
+
+struct tunebook_profile {
+  double seconds;
+  int64_t evaluations;
+  struct tunebook_profile_table lines, instruments, oscillators, stacks;
+};
+
+static int profile = 0;
+static char *profile_folded = NULL;
+
+// a note as scheduled by a first pass over a voice's commands: where it
+// starts and how long it is, where each of its chord lanes stops, earlier
+// if it is stolen, and everything needed to render it later on its own;
+// first and last are the part of it within the render window
+struct tunebook_note {
+  long time;
+  int beat_length, length, legato_end, carrier, n_notes, stop[CHORD_LANES], end, first, last;
+  double root, prev_freq[CHORD_LANES], targ_freq[CHORD_LANES];
+};
+
+// the longest a beat or a note may be, in samples, about 23 minutes,
+// so that lengths stay well within an int even oversampled
+#define MAX_NOTE_LENGTH (INT_MAX / (2 * MAX_OVERSAMPLE))
+
+// a stolen note is faded out over this many samples rather than cut
+#define STEAL_FADE (SAMPLE_RATE / 200)
+
+struct tunebook_render_context {
+  long beat, osc;
+  int n_sections, s_sections, *sections;
+  double base, root, tempo, legato;
+  // the run of the current groove in the voice's notes pool, and the
+  // last note or chord played, if any
+  const uint32_t *groove;
+  int last_freq_command;
+  // scratch space for one control period of every chord lane, each
+  // CHORD_LANES * control_period long: an output buffer per oscillator,
+  // the inputs of the oscillator being computed and five more for whole
+  // block waves, and the note frequency; and the state of every lane of
+  // every oscillator's filter; the output buffers and note frequency
+  // are repeated for each of the n_batch blocks a batch can hold, and
+  // points holds where each block of the batch starts
+  double *buffers, *inputs, *freq, *filters;
+  int n_batch, *points;
+  // the points of each chord lane of an oversampled note which are still
+  // to be filtered down to the sample rate
+  double *window;
+  // the part of the song being rendered, from sample `from` up to but
+  // not including sample `to`; `time` is where the next command starts
+  // and `end` where the song's last sound ends
+  long from, to, time, end, n_samples, s_samples;
+  float *samples;
+  // what the voice has cost so far; a dry run only counts
+  int dry;
+  long n_notes, n_chords;
+  int64_t evaluations;
+  // the evaluations of the book's voices before this one, and why the
+  // book has stopped rendering, if it has
+  int64_t spent;
+  int halted;
+  // the bytes the song's buffers take for each sample it is long
+  int frame_bytes;
+  // when profiling, the song and voice being rendered, the command
+  // being played and the repeats it is inside of, and the time spent
+  // on each oscillator of the current note
+  struct tunebook_profile *profile;
+  struct tunebook_song *song;
+  struct tunebook_voice *voice;
+  int command, n_repeats, s_repeats, *repeats;
+  double *osc_seconds;
+  // the notes of a voice with a polyphony limit, written down rather
+  // than rendered while scheduling, then played back in the same order
+  int scheduling;
+  struct tunebook_note *notes;
+  long n_scheduled, s_scheduled, n_played;
+  // the threads computing independent oscillators at once, if any
+  struct tunebook_pool *pool;
+};
+
+osc_fun shape_function(enum tunebook_shape shape) {
+  switch (shape) {
+  case OSC_SAW: return saw;
+  case OSC_TRIANGLE: return triangle;
+  case OSC_SQUARE: return square;
+  case OSC_NOISE: return noise;
+  case OSC_SINE:
+  case OSC_HARMONICS:
+  case OSC_WAVETABLE:
+  case OSC_BUS: break;
+  }
+  return sin;
+}
+
+osc_fun wave_function(struct tunebook_oscillator *osc) {
+  return shape_function(osc->shape);
+}
+
+double envelope_at(struct tunebook_oscillator *osc, int point, int beat_length) {
   int attack = osc->attack * beat_length;
   int decay = attack + (osc->decay * (double)beat_length);
-  switch (osc->shape) {
-  case OSC_SAW: wave_func = saw; break;
-  case OSC_TRIANGLE: wave_func = triangle; break;
-  case OSC_SQUARE: wave_func = square; break;
-  case OSC_SINE: wave_func = sin; break;
-  case OSC_NOISE: wave_func = noise; break;
-  }
-  double fm = 0, am = 0, pm = 0, add = 0, sub = 0, env = 0;
-  for (int i = 0; i < instrument->n_oscillators; ++i) {
-    if (i == osc_i) continue;
-    for (int j = 0; j < instrument->oscillators[i].n_am_targets; ++j) {
-      if (strcmp(osc->name, instrument->oscillators[i].am_targets[j])) continue;
-      am += amp_at_point(point, beat_length, freq, instrument, i);
-    }
-    for (int j = 0; j < instrument->oscillators[i].n_fm_targets; ++j) {
-      if (strcmp(osc->name, instrument->oscillators[i].fm_targets[j])) continue;
-      fm += amp_at_point(point, beat_length, freq, instrument, i);
-    }
-    for (int j = 0; j < instrument->oscillators[i].n_pm_targets; ++j) {
-      if (strcmp(osc->name, instrument->oscillators[i].pm_targets[j])) continue;
-      pm += amp_at_point(point, beat_length, freq, instrument, i);
-    }
-    for (int j = 0; j < instrument->oscillators[i].n_add_targets; ++j) {
-      if (strcmp(osc->name, instrument->oscillators[i].add_targets[j])) continue;
-      add += amp_at_point(point, beat_length, freq, instrument, i);
-    }
-    for (int j = 0; j < instrument->oscillators[i].n_sub_targets; ++j) {
-      if (strcmp(osc->name, instrument->oscillators[i].sub_targets[j])) continue;
-      sub += amp_at_point(point, beat_length, freq, instrument, i);
-    }
-    for (int j = 0; j < instrument->oscillators[i].n_env_targets; ++j) {
-      if (strcmp(osc->name, instrument->oscillators[i].env_targets[j])) continue;
-      n_env++;
-      env += amp_at_point(point, beat_length, freq, instrument, i);
-    }
-  }
-  freq *= osc->detune;
-  if (osc->hz) freq = osc->hz;
-  double amp = (1 + am) * osc->volume * wave_func((point + pm) * (freq * 1 + fm) * 2 * M_PI / SAMPLE_RATE);
-  amp += add;
-  amp -= sub;
-  if (n_env) {
-    if (env < 0) amp = MAX(env, MIN(0, amp));
-    else amp = MIN(env, MAX(0, amp));
-  }
   if (point < attack) {
-    if (attack) amp *= (double)point/attack;
+    return (double)point/attack;
   } else if (point < decay) {
-    if (decay != attack) {
-      double q = (double)(point-attack)/(decay-attack);
-      amp *= 1 - (q * (1 - osc->sustain));
-    }
+    double q = (double)(point-attack)/(decay-attack);
+    return 1 - (q * (1 - osc->sustain));
   } else if (point < beat_length) {
-    amp *= osc->sustain;
+    return osc->sustain;
   } else {
     int release_end = beat_length * osc->release;
-    if (release_end <= 0) {
-      amp = 0;
-    } else {
-      double q = (double)(point - beat_length)/release_end;
-      amp *= (1 - q) * osc->sustain;
-    }
+    if (release_end <= 0) return 0;
+    double q = (double)(point - beat_length)/release_end;
+    return (1 - q) * osc->sustain;
   }
-  if (osc->clip > 0 && fabs(amp) > osc->clip) {
-    amp = copysign(osc->clip, amp);
+}
+
+// a note stops being rendered once its carrier's envelope keeps it below
+// a sixteenth of a step of 16 bit output, so that even the tails of many
+// overlapping notes cannot add up to a step
+#define SILENCE 0x1p-20
+
+// how much of a note of the given length is worth rendering; the size
+// of the envelope only falls after the attack when the sustain is
+// between 0 and 1, and otherwise once the sustain is reached, since a
+// decay to a negative sustain passes through zero, so from there the
+// point where it goes quiet for good is found by bisection
+int audible_length(struct tunebook_oscillator *carrier, int beat_length, int length) {
+  int attack = carrier->attack * beat_length;
+  int decay = attack + (carrier->decay * (double)beat_length);
+  int falling = 0 <= carrier->sustain && carrier->sustain <= 1;
+  int lo = falling ? attack : MAX(decay, beat_length), hi = length;
+  if (carrier->peak < SILENCE) return 0;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (fabs(envelope_at(carrier, mid, beat_length)) * carrier->peak < SILENCE) hi = mid;
+    else lo = mid + 1;
   }
-  return amp;
+  return MIN(lo, length);
 }
 
-void write_note
-(FILE *out_file, int beat_length,
- double legato, double prev_freq, double targ_freq,
- struct tunebook_instrument *instrument, int osc_i) {
-  SAMPLE sample;
-  int length = beat_length * (1 + instrument->oscillators[osc_i].release);
-  int legato_end = floor(beat_length * legato);
-  double diff_freq = targ_freq - prev_freq;
-  for (int i = 0; i < length; ++i) {
-    if (0 == fread(&sample, sizeof sample, 1, out_file)) sample = 0;
-    else fseek(out_file, -sizeof sample, SEEK_CUR);
-    double freq;
-    if (i >= legato_end || prev_freq == 0) freq = targ_freq;
-    else {
-      double p = ((float)i)/((float)legato_end);
-      double t = 1 - pow(1 - p, 3);
-      freq = prev_freq + (diff_freq * t);
-    }
-    double amp = amp_at_point(i, beat_length, freq, instrument, osc_i);
-    if (amp > 1) amp = 1;
-    if (amp < -1) amp = -1;
-    sample += SAMPLE_MAX * amp;
-    fwrite(&sample, sizeof sample, 1, out_file);
+// the envelope is linear between these points, so splitting control
+// periods on them keeps interpolation exact
+int next_breakpoint
+(struct tunebook_instrument *instrument, struct tunebook_oscillator *carrier,
+ int point, int end, int beat_length, int legato_end) {
+  if (point < legato_end && legato_end < end) end = legato_end;
+  for (int i = 0; i < carrier->n_order; ++i) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[carrier->order[i]];
+    int attack = osc->attack * beat_length;
+    int decay = attack + (osc->decay * (double)beat_length);
+    if (point < attack && attack < end) end = attack;
+    if (point < decay && decay < end) end = decay;
+    if (point < beat_length && beat_length < end) end = beat_length;
   }
-  fseek(out_file, (sizeof sample) * (beat_length-length), SEEK_CUR);
+  return end;
 }
 
-struct tunebook_render_context {
-  int beat, osc, n_sections, s_sections, *sections;
-  double base, root, tempo, legato;
-  struct tunebook_chord *groove;
-  struct tunebook_voice_command *last_freq_command;
-};
+double glide_at
+(int i, int legato_end, double prev_freq, double targ_freq) {
+  if (i >= legato_end || prev_freq == 0) return targ_freq;
+  double p = ((float)i)/((float)legato_end);
+  double t = 1 - pow(1 - p, 3);
+  return prev_freq + ((targ_freq - prev_freq) * t);
+}
 
-double previous_frequency(struct tunebook_render_context *cx, int chord_n) {
-  // TODO handle base/modulate/other commands that change our basis
-  if (!cx->last_freq_command) return 0;
-  switch (cx->last_freq_command->type) {
-  case VOICE_COMMAND_CHORD:
-    if (chord_n >= cx->last_freq_command->as.chord.n_notes) return 0;
-    return cx->root * number_to_double(cx->base, cx->last_freq_command->as.chord.notes[chord_n]);
-  case VOICE_COMMAND_NOTE:
-    return cx->root * number_to_double(cx->base, cx->last_freq_command->as.note);
-  default:
-    return 0;
+// an unmodulated, smooth, low-frequency modulator changes so little
+// within a control period that it can be evaluated at its edges only
+int is_control_rate(struct tunebook_oscillator *osc) {
+  if (!osc->modulator || osc->n_routes || !osc->hz || osc->filter || osc->unison > 1) return 0;
+  if (osc->shape != OSC_SINE) return 0;
+  return fabs(osc->hz) * control_period * 2 * M_PI / (SAMPLE_RATE * osc->oversample)
+    <= MAX_CONTROL_STEP;
+}
+
+int prepare_order
+(struct tunebook_instrument *instrument, int o, char *mark,
+ struct tunebook_oscillator *carrier) {
+  struct tunebook_oscillator *osc = &instrument->oscillators[o];
+  if (mark[o] == 2) return 0;
+  if (mark[o] == 1) return -1;
+  mark[o] = 1;
+  osc->level = 0;
+  for (int r = 0; r < osc->n_routes; ++r) {
+    struct tunebook_oscillator *source = &instrument->oscillators[osc->routes[r].source];
+    if (prepare_order(instrument, osc->routes[r].source, mark, carrier)) return -1;
+    osc->level = MAX(osc->level, source->level + 1);
   }
+  mark[o] = 2;
+  carrier->order[carrier->n_order++] = o;
+  return 0;
 }
 
-void process_command
-(struct tunebook_render_context *cx,
- FILE *out_file,
- struct tunebook_instrument *instrument,
- struct tunebook_voice *voice,
- int command_i) {
-  SAMPLE sample;
-  int length, current_repeat;
-  struct tunebook_voice_command *command = &voice->commands[command_i];
-  int pos = ftell(out_file);
-  switch (command->type) {
-  case VOICE_COMMAND_BASE:
-    cx->base = number_to_double(cx->base, command->as.base);
-    break;
-  case VOICE_COMMAND_LEGATO:
-    cx->legato = number_to_double(cx->base, command->as.legato);
-    break;
-  case VOICE_COMMAND_MODULATE:
-    cx->root *= number_to_double(cx->base, command->as.modulate);
-    break;
-  case VOICE_COMMAND_GROOVE:
-    cx->groove = &command->as.groove;
-    cx->beat = 0;
-    break;
-  case VOICE_COMMAND_SECTION:
-    if (++cx->n_sections >= cx->s_sections) {
-      cx->s_sections *= 2;
-      RESIZE(cx->sections, cx->s_sections);
-    }
-    cx->sections[cx->n_sections-1] = command_i;
-    break;
-  case VOICE_COMMAND_REPEAT:
-    current_repeat = cx->sections[--cx->n_sections]+1;
-    for (int repeat_i = floor(number_to_double(cx->base, command->as.repeat)); repeat_i > 0; --repeat_i)
-      for (int r = current_repeat; r < command_i; ++r) {
-	process_command(cx, out_file, instrument, voice, r);
-      }
-    break;
-  case VOICE_COMMAND_CHORD:
-    length = SAMPLE_RATE * 60 / cx->tempo;
-    if (cx->groove && cx->groove->n_notes > 0)
-      length *= number_to_double(1, cx->groove->notes[cx->beat % cx->groove->n_notes]);
-    for (int n = 0; n < command->as.chord.n_notes; ++n) {
-      double prev_freq = previous_frequency(cx, n);
-      double targ_freq = cx->root * number_to_double(cx->base, command->as.chord.notes[n]);
-      while (is_modulator(instrument, cx->osc % instrument->n_oscillators)) ++cx->osc;
-      write_note(out_file, length, cx->legato, prev_freq, targ_freq, instrument, cx->osc % instrument->n_oscillators);
-      ++cx->osc;
-      if ((n + 1) < command->as.chord.n_notes)
-	fseek(out_file, pos, SEEK_SET);
-    }
-    ++cx->beat;
-    cx->last_freq_command = command;
-    break;
-  case VOICE_COMMAND_NOTE:
-    length = SAMPLE_RATE * 60 / cx->tempo;
-    if (cx->groove && cx->groove->n_notes > 0)
-      length *= number_to_double(1, cx->groove->notes[cx->beat++ % cx->groove->n_notes]);
-    double prev_freq = previous_frequency(cx, 0);
-    double targ_freq = cx->root * number_to_double(cx->base, command->as.note);
-    while (is_modulator(instrument, cx->osc % instrument->n_oscillators)) ++cx->osc;
-    write_note(out_file, length, cx->legato, prev_freq, targ_freq, instrument, cx->osc % instrument->n_oscillators);
-    ++cx->osc;
-    cx->last_freq_command = command;
-    break;
-  case VOICE_COMMAND_REST:
-    length = SAMPLE_RATE * 60 / cx->tempo;
-    if (cx->groove && cx->groove->n_notes > 0)
-      length *= number_to_double(1, cx->groove->notes[cx->beat++ % cx->groove->n_notes]);
-    for (int i = 0; i < length; ++i) {
-      if (0 == fread(&sample, sizeof sample, 1, out_file)) sample = 0;
-      else fseek(out_file, -sizeof sample, SEEK_CUR);
-      fwrite(&sample, sizeof sample, 1, out_file);
+static struct tunebook_wavetable *wavetables = NULL;
+
+// map a wavetable's file, or find it already mapped; like an included
+// file, a wavetable is read again once it has changed on disk, and the
+// mapping books before read from is left to them
+struct tunebook_wavetable *load_wavetable(char *path) {
+  struct tunebook_wavetable *table;
+  struct stat st;
+  if (!stat(path, &st))
+    for (table = wavetables; table; table = table->next)
+      if (!strcmp(table->path, path) && table->mtime.tv_sec == st.st_mtim.tv_sec
+          && table->mtime.tv_nsec == st.st_mtim.tv_nsec
+          && table->n_samples == st.st_size / (long)sizeof(SAMPLE)) return table;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return NULL;
+  }
+  NEW(table, 1);
+  table->path = path;
+  table->mtime = st.st_mtim;
+  table->n_samples = st.st_size / sizeof(SAMPLE);
+  table->bytes = NULL;
+  if (table->n_samples) {
+    table->bytes = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (table->bytes == MAP_FAILED) {
+      close(fd);
+      free(table);
+      return NULL;
     }
-    break;
   }
+  close(fd);
+  table->next = wavetables;
+  wavetables = table;
+  return table;
 }
 
-int tunebook_write_book
-(struct tunebook_book *book, struct tunebook_error *error) {
-  int n_filename;
-  char *filename;
-  struct tunebook_song *song;
-  struct tunebook_voice *voice;
-  struct tunebook_instrument *instrument = NULL;
-  FILE *out_file;
-  struct tunebook_render_context cx;
-  cx.s_sections = 8;
-  cx.n_sections = 0;
-  NEW(cx.sections, cx.s_sections);
-  printf("book has %i %s to render\n", book->n_songs, book->n_songs == 1 ? "song" : "songs");
-  for (int s = 0 ; s < book->n_songs; ++s) {
-    song = &book->songs[s];
-    printf("song %i: %s\n\tvoices: %i\n", s+1, song->name, song->n_voices);
-    n_filename = 4 + strlen(song->name);
-    filename = malloc(n_filename);
-    strcpy(filename, song->name);
-    strcpy(filename + n_filename - 4, ".l16");
-    out_file = fopen(filename, "w+");
-    for (int v = 0; v < song->n_voices; ++v) {
-      cx.groove = NULL;
-      cx.last_freq_command = NULL;
-      cx.base = 2;
-      cx.tempo = song->tempo;
-      cx.root = song->root;
-      cx.osc = 0;
-      cx.beat = 0;
-      cx.legato = 0;
-      voice = &song->voices[v];
-      printf("\t- %s", voice->instrument);
-      fseek(out_file, 0, SEEK_SET);
-      for (int i = 0; i < book->n_instruments; ++i) {
-	instrument = &book->instruments[i];
-	if (!strcmp(voice->instrument, instrument->name)) break;
-      }
-      for (int c = 0; c < voice->n_commands; ++c) {
-	int progress = 100 * ((double)c/voice->n_commands);
-	if (progress % 10 == 0) {
-	  putchar('.');
-	  fflush(stdout);
-	}
-	process_command(&cx, out_file, instrument, voice, c);
-      }
-      putchar('\n');
+// spread the copies of a unison oscillator evenly across its detune
+// range, each starting from a random but repeatable phase within a
+// cycle; a wavetable's phase is a place in its recording rather than in
+// a cycle, so its copies all start from the beginning
+void prepare_unison(struct tunebook_oscillator *osc) {
+  uint64_t seed = fnv1a(NOISE_SEED, osc->name, strlen(osc->name));
+  int random_phase = osc->unison > 1 && osc->shape != OSC_WAVETABLE;
+  NEW(osc->unison_ratios, osc->unison);
+  NEW(osc->unison_phases, osc->unison);
+  for (int c = 0; c < osc->unison; ++c) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    osc->unison_ratios[c] = osc->unison > 1
+      ? 1 + osc->spread * ((double)c / (osc->unison - 1) - 0.5) : 1;
+    osc->unison_phases[c] = random_phase ? (seed >> 11) * 0x1p-53 * 2 * M_PI : 0;
+  }
+}
+
+// the most an oscillator could put out before its envelope, from its
+// volume, its shape, its filter's resonance and the most its sources
+// could add; sources come first in every order, so theirs are known
+void prepare_peak(struct tunebook_instrument *instrument, struct tunebook_oscillator *osc) {
+  double in[ROUTE_CUTOFF + 1] = { 0 }, wave = 1;
+  for (int r = 0; r < osc->n_routes; ++r) {
+    struct tunebook_oscillator *source = &instrument->oscillators[osc->routes[r].source];
+    double peak = source->peak * MAX(1, source->sustain);
+    in[osc->routes[r].kind] += source->clip > 0 ? MIN(peak, source->clip) : peak;
+  }
+  if (osc->shape == OSC_HARMONICS) {
+    wave = 0;
+    for (int h = 0; h < osc->partials.n_notes; ++h)
+      wave += fabs(number_to_double(1, osc->partials.notes[h]));
+  }
+  wave *= sqrt(osc->unison);
+  osc->peak = fabs(osc->volume) * (1 + in[ROUTE_AM]) * wave + in[ROUTE_ADD] + in[ROUTE_SUB];
+  if (osc->filter) osc->peak *= MAX(1, 2 * osc->resonance);
+}
+
+// an oversampled instrument is brought back down to the sample rate by a
+// windowed sinc lowpass cutting off at the output's Nyquist frequency,
+// which reaches DECIMATE_REACH samples of output either side of the one
+// it makes; it is only evaluated for the samples which are kept, so its
+// cost is that of a polyphase decimator
+#define DECIMATE_REACH 16
+
+static double *decimate_taps[MAX_OVERSAMPLE + 1];
+
+void prepare_decimator(int oversample) {
+  int reach = DECIMATE_REACH * oversample, n_taps = 2 * reach + 1;
+  double *taps, sum = 0;
+  if (oversample == 1 || decimate_taps[oversample]) return;
+  NEW(taps, n_taps);
+  for (int j = 0; j < n_taps; ++j) {
+    double x = (double)(j - reach) / oversample, w = 2 * M_PI * j / (n_taps - 1);
+    taps[j] = x ? sin(M_PI * x) / (M_PI * x) : 1;
+    taps[j] *= 0.42 - 0.5 * cos(w) + 0.08 * cos(2 * w);
+    sum += taps[j];
+  }
+  for (int j = 0; j < n_taps; ++j) taps[j] /= sum;
+  decimate_taps[oversample] = taps;
+}
+
+// how many points of each lane an oversampled note keeps at once: a
+// block, and what the filter reaches back and forward over
+int oversample_window(struct tunebook_instrument *instrument) {
+  return control_period + (2 * DECIMATE_REACH + 1) * instrument->oversample;
+}
+
+// work out, for every oscillator, which oscillators feed into it and in
+// what order they must be computed
+int tunebook_prepare_instrument
+(struct tunebook_instrument *instrument, struct tunebook_error *error) {
+  char *mark;
+  if (instrument->origin) {
+    struct tunebook_instrument *origin = instrument->origin;
+    if (tunebook_prepare_instrument(origin, error)) return -1;
+    *instrument = *origin;
+    instrument->origin = origin;
+    return 0;
+  }
+  if (instrument->prepared) return 0;
+  tunebook_link_instrument(instrument);
+  NEW(mark, instrument->n_oscillators);
+  for (int o = 0; o < instrument->n_oscillators; ++o) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[o];
+    memset(mark, 0, instrument->n_oscillators);
+    osc->n_order = 0;
+    NEW(osc->order, instrument->n_oscillators);
+    osc->oversample = instrument->oversample;
+    osc->control_rate = is_control_rate(osc);
+    prepare_unison(osc);
+    if (osc->shape == OSC_WAVETABLE && !(osc->table = load_wavetable(osc->wavetable))) {
+      free(mark);
+      error->type = ERROR_FILE_NOT_FOUND;
+      error->last_token.type = TOKEN_STRING;
+      error->last_token.as.string = osc->wavetable;
+      return -1;
     }
-    fclose(out_file);
-    free(filename);
+    if (prepare_order(instrument, o, mark, osc)) {
+      free(mark);
+      error->type = ERROR_CYCLIC_ROUTE;
+      error->last_token.type = TOKEN_STRING;
+      error->last_token.as.string = osc->name;
+      return -1;
+    }
+  }
+  // oscillators on the same level do not depend on each other, so each
+  // carrier's order is grouped by level to let their filters run together
+  for (int o = 0; o < instrument->n_oscillators; ++o) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[o];
+    for (int i = 1; i < osc->n_order; ++i) {
+      int j = i, moved = osc->order[i];
+      for (; j > 0 && instrument->oscillators[osc->order[j-1]].level
+             > instrument->oscillators[moved].level; --j)
+        osc->order[j] = osc->order[j-1];
+      osc->order[j] = moved;
+    }
+    for (int i = 0; i < osc->n_order; ++i)
+      prepare_peak(instrument, &instrument->oscillators[osc->order[i]]);
   }
+  free(mark);
+  prepare_decimator(instrument->oversample);
+  instrument->prepared = 1;
   return 0;
 }
 
-int main() {
-  struct tunebook_book book;
-  struct tunebook_error error;
-  if (tunebook_read_file(stdin, &book, &error)) goto error;
-  if (tunebook_write_book(&book, &error)) goto error;
+double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+double control_value
+(struct tunebook_oscillator *osc, int point, int beat_length) {
+  double amp = osc->volume
+    * wave_function(osc)(point * osc->hz * 2 * M_PI / (SAMPLE_RATE * osc->oversample));
+  amp *= envelope_at(osc, point, beat_length);
+  if (osc->clip > 0 && fabs(amp) > osc->clip) amp = copysign(osc->clip, amp);
+  return amp;
+}
+
+// filters are state variable filters in trapezoidal form; all the
+// filters of one level of an instrument are run together, one lane each,
+// so that every step of a sample is taken for all of them at once
+#define FILTER_LANES 8
+
+struct tunebook_filter_lanes {
+  int n;
+  struct tunebook_oscillator *osc[FILTER_LANES];
+  double *out[FILTER_LANES], *state[FILTER_LANES];
+  double g0[FILTER_LANES], g1[FILTER_LANES], k[FILTER_LANES];
+  double low[FILTER_LANES], band[FILTER_LANES], high[FILTER_LANES];
+  double e0[FILTER_LANES], e1[FILTER_LANES];
+};
+
+// the prewarped cutoff of a filter moved by the given octaves, kept
+// inside the audible range
+double filter_gain(struct tunebook_oscillator *osc, double octaves) {
+  double cutoff = osc->cutoff * exp2(octaves);
+  cutoff = MIN(MAX(cutoff, 1), 0.45 * SAMPLE_RATE * osc->oversample);
+  return tan(M_PI * cutoff / (SAMPLE_RATE * osc->oversample));
+}
+
+void add_filter_lane
+(struct tunebook_filter_lanes *lanes, struct tunebook_oscillator *osc,
+ double *out, double *state, double g0, double g1, double e0, double e1) {
+  int l = lanes->n++;
+  lanes->osc[l] = osc;
+  lanes->out[l] = out;
+  lanes->state[l] = state;
+  lanes->g0[l] = g0;
+  lanes->g1[l] = g1;
+  lanes->k[l] = osc->resonance > 0 ? 1 / osc->resonance : M_SQRT2;
+  lanes->low[l] = osc->filter == FILTER_LOWPASS;
+  lanes->band[l] = osc->filter == FILTER_BANDPASS ? lanes->k[l] : 0;
+  lanes->high[l] = osc->filter == FILTER_HIGHPASS;
+  lanes->e0[l] = e0;
+  lanes->e1[l] = e1;
+}
+
+// filter n samples in every lane, then apply each oscillator's envelope
+// and clipping, which come after its filter
+void run_filter_lanes(struct tunebook_filter_lanes *lanes, int n) {
+  double ic1[FILTER_LANES], ic2[FILTER_LANES], step = n > 1 ? 1.0 / (n - 1) : 0;
+  int m = lanes->n;
+  for (int l = 0; l < m; ++l) {
+    ic1[l] = lanes->state[l][0];
+    ic2[l] = lanes->state[l][1];
+  }
+  for (int i = 0; i < n; ++i) {
+    for (int l = 0; l < m; ++l) {
+      double g = lanes->g0[l] + (lanes->g1[l] - lanes->g0[l]) * (i * step);
+      double a1 = 1 / (1 + g * (g + lanes->k[l])), a2 = g * a1, a3 = g * a2;
+      double v0 = lanes->out[l][i], v3 = v0 - ic2[l];
+      double v1 = a1 * ic1[l] + a2 * v3, v2 = ic2[l] + a2 * ic1[l] + a3 * v3;
+      ic1[l] = 2 * v1 - ic1[l];
+      ic2[l] = 2 * v2 - ic2[l];
+      lanes->out[l][i] = lanes->low[l] * v2 + lanes->band[l] * v1
+        + lanes->high[l] * (v0 - lanes->k[l] * v1 - v2);
+    }
+  }
+  for (int l = 0; l < m; ++l) {
+    struct tunebook_oscillator *osc = lanes->osc[l];
+    double *out = lanes->out[l];
+    lanes->state[l][0] = ic1[l];
+    lanes->state[l][1] = ic2[l];
+    for (int i = 0; i < n; ++i) {
+      double amp = out[i] * (lanes->e0[l] + (lanes->e1[l] - lanes->e0[l]) * (i * step));
+      if (osc->clip > 0 && fabs(amp) > osc->clip) amp = copysign(osc->clip, amp);
+      out[i] = amp;
+    }
+  }
+  lanes->n = 0;
+}
+
+// add the sum of an oscillator's harmonics at each of n phases to wave, using the
+// Chebyshev recurrence sin(h x) = 2 cos(x) sin((h-1) x) - sin((h-2) x);
+// the recurrence is taken a harmonic at a time for the whole block, so
+// that each step is one multiply-add across all the samples
+void harmonics_block
+(struct tunebook_oscillator *osc, const double *phase, int n, double *scratch, double *wave) {
+  double *twice_cos = scratch, *previous = twice_cos + CHORD_LANES * control_period,
+    *current = previous + CHORD_LANES * control_period;
+  double a = osc->partials.n_notes ? number_to_double(1, osc->partials.notes[0]) : 0;
+  for (int k = 0; k < n; ++k) {
+    twice_cos[k] = 2 * cos(phase[k]);
+    previous[k] = 0;
+    current[k] = sin(phase[k]);
+    wave[k] += a * current[k];
+  }
+  for (int h = 1; h < osc->partials.n_notes; ++h) {
+    a = number_to_double(1, osc->partials.notes[h]);
+    for (int k = 0; k < n; ++k) {
+      double next = twice_cos[k] * current[k] - previous[k];
+      previous[k] = current[k];
+      current[k] = next;
+      wave[k] += a * next;
+    }
+  }
+}
+
+double wavetable_sample(struct tunebook_wavetable *table, int loop, long i) {
+  if (loop) i = ((i % table->n_samples) + table->n_samples) % table->n_samples;
+  else if (i < 0 || i >= table->n_samples) return 0;
+  int16_t sample = table->bytes[2 * i] | table->bytes[2 * i + 1] << 8;
+  return (double)sample / SAMPLE_MAX;
+}
+
+// read a wavetable between samples, with four point Hermite interpolation
+double wavetable_at(struct tunebook_oscillator *osc, double position) {
+  struct tunebook_wavetable *table = osc->table;
+  if (!table->n_samples) return 0;
+  if (osc->loop) position = fmod(position, table->n_samples);
+  else if (position <= -1 || position >= table->n_samples) return 0;
+  long i = floor(position);
+  double f = position - i;
+  double y0 = wavetable_sample(table, osc->loop, i - 1), y1 = wavetable_sample(table, osc->loop, i),
+    y2 = wavetable_sample(table, osc->loop, i + 1), y3 = wavetable_sample(table, osc->loop, i + 2);
+  double c1 = 0.5 * (y2 - y0), c2 = y0 - 2.5 * y1 + 2 * y2 - 0.5 * y3,
+    c3 = 0.5 * (y3 - y0) + 1.5 * (y1 - y2);
+  return ((c3 * f + c2) * f + c1) * f + y1;
+}
+
+// work out an lfo for every control period up to the given point of
+// the song which it has not reached yet
+void lfo_reserve(struct tunebook_lfo *lfo, long time) {
+  long c = time / control_period;
+  if (c + 1 < lfo->n_values) return;
+  long n = MAX(c + 2, 2 * lfo->n_values);
+  osc_fun wave_func = shape_function(lfo->shape);
+  RESIZE(lfo->values, n);
+  for (long v = lfo->n_values; v < n; ++v)
+    lfo->values[v] = wave_func(v * control_period * lfo->hz * 2 * M_PI / SAMPLE_RATE);
+  lfo->n_values = n;
+}
+
+// an lfo at a point of the song, between the control periods either
+// side of it
+double lfo_at(struct tunebook_lfo *lfo, long time) {
+  long c = time / control_period;
+  lfo_reserve(lfo, time);
+  double f = (double)(time - c * control_period) / control_period;
+  return lfo->values[c] + (lfo->values[c + 1] - lfo->values[c]) * f;
+}
+
+// the wave of an oscillator over a block, for the shapes which are made
+// a block at a time: harmonics, wavetables, buses, and unison copies of
+// any shape; buses read their lfo at the block's place in the song, the
+// same for every note; wavetables play at their own speed when the frequency is the
+// song's root, and faster or slower in proportion to it; each
+// copy is a lane with its own detune and starting phase, and the copies
+// are scaled to be as loud together as one would be alone; n samples are
+// made for each of n_notes chord lanes
+void wave_block
+(struct tunebook_render_context *cx, struct tunebook_oscillator *osc,
+ int point, int n, int n_notes, const double *pm, const double *fm,
+ double *phase, double *wave) {
+  int span = CHORD_LANES * control_period, m = n * n_notes, rate = SAMPLE_RATE * osc->oversample;
+  double *scratch = phase + span;
+  osc_fun wave_func = wave_function(osc);
+  if (osc->shape == OSC_BUS) {
+    for (int k = 0; k < n; ++k)
+      wave[k] = lfo_at(osc->lfo, cx->time + (point + k) / osc->oversample);
+    for (int l = 1; l < n_notes; ++l) memcpy(wave + l * n, wave, n * sizeof *wave);
+    return;
+  }
+  memset(wave, 0, m * sizeof *wave);
+  for (int c = 0; c < osc->unison; ++c) {
+    double ratio = osc->unison_ratios[c], offset = osc->unison_phases[c];
+    for (int l = 0, j = 0; l < n_notes; ++l)
+      for (int k = 0; k < n; ++k, ++j) {
+        double freq = osc->hz ? osc->hz : cx->freq[j] * osc->detune;
+        phase[j] = (point + k + pm[j]) * (freq * ratio + fm[j]) * 2 * M_PI / rate + offset;
+      }
+    switch (osc->shape) {
+    case OSC_HARMONICS: harmonics_block(osc, phase, m, scratch, wave); break;
+    case OSC_WAVETABLE:
+      for (int j = 0; j < m; ++j)
+        wave[j] += wavetable_at(osc, phase[j] * SAMPLE_RATE / (2 * M_PI * cx->root));
+      break;
+    case OSC_SINE: for (int j = 0; j < m; ++j) wave[j] += sin(phase[j]); break;
+    case OSC_SAW: for (int j = 0; j < m; ++j) wave[j] += saw(phase[j]); break;
+    case OSC_TRIANGLE: for (int j = 0; j < m; ++j) wave[j] += triangle(phase[j]); break;
+    case OSC_SQUARE: for (int j = 0; j < m; ++j) wave[j] += square(phase[j]); break;
+    default: for (int j = 0; j < m; ++j) wave[j] += wave_func(phase[j]); break;
+    }
+  }
+  if (osc->unison > 1) {
+    double scale = 1 / sqrt(osc->unison);
+    for (int j = 0; j < m; ++j) wave[j] *= scale;
+  }
+}
+
+// compute n samples of one oscillator, starting at the given point of
+// the note, for each of n_notes chord lanes, using work as scratch space
+// for its inputs and wave; lane l of an oscillator is the n samples from
+// l * n in its buffer; a filtered oscillator is only queued on the filter
+// lanes, and is finished when they are run
+void render_oscillator
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument, int o,
+ int point, int n, int n_notes, int beat_length,
+ double *work, struct tunebook_filter_lanes *lanes) {
+  int span = CHORD_LANES * control_period, m = n * n_notes;
+  struct tunebook_oscillator *osc = &instrument->oscillators[o];
+  int rate = SAMPLE_RATE * osc->oversample;
+  double *out = cx->buffers + o * span;
+  double *am = work, *fm = am + span, *pm = fm + span,
+    *add = pm + span, *sub = add + span, *env = sub + span,
+    *cut = env + span, *phase = cut + span, *wave = phase + 4 * span;
+  double *in[] = { am, fm, pm, add, sub, env, cut };
+  int last = point + n - 1;
+  double step = n > 1 ? 1.0 / (n - 1) : 0;
+  if (osc->control_rate) {
+    double a = control_value(osc, point, beat_length);
+    double b = control_value(osc, last, beat_length);
+    for (int l = 0, j = 0; l < n_notes; ++l)
+      for (int k = 0; k < n; ++k, ++j) out[j] = a + (b - a) * (k * step);
+    return;
+  }
+  int n_env = 0;
+  for (int r = 0; r < 7; ++r) memset(in[r], 0, m * sizeof *in[r]);
+  for (int r = 0; r < osc->n_routes; ++r) {
+    double *src = cx->buffers + osc->routes[r].source * span;
+    double *dst = in[osc->routes[r].kind];
+    if (osc->routes[r].kind == ROUTE_ENV) n_env++;
+    for (int j = 0; j < m; ++j) dst[j] += src[j];
+  }
+  osc_fun wave_func = wave_function(osc);
+  double g0 = envelope_at(osc, point, beat_length);
+  double g1 = envelope_at(osc, last, beat_length);
+  int whole_block = osc->shape == OSC_HARMONICS || osc->shape == OSC_WAVETABLE
+    || osc->shape == OSC_BUS || osc->unison > 1;
+  if (whole_block) wave_block(cx, osc, point, n, n_notes, pm, fm, phase, wave);
+  if (osc->filter) {
+    if (lanes->n + n_notes > FILTER_LANES) run_filter_lanes(lanes, n);
+    for (int l = 0; l < n_notes; ++l)
+      add_filter_lane(lanes, osc, out + l * n, cx->filters + 2 * (o * CHORD_LANES + l),
+                      filter_gain(osc, cut[l * n]), filter_gain(osc, cut[l * n + n - 1]),
+                      g0, g1);
+    g0 = g1 = 1;
+  }
+  for (int l = 0, j = 0; l < n_notes; ++l) {
+    for (int k = 0; k < n; ++k, ++j) {
+      double amp = (1 + am[j]) * osc->volume;
+      if (whole_block) amp *= wave[j];
+      else {
+        double freq = osc->hz ? osc->hz : cx->freq[j] * osc->detune;
+        amp *= wave_func((point + k + pm[j]) * (freq * 1 + fm[j]) * 2 * M_PI / rate);
+      }
+      amp += add[j];
+      amp -= sub[j];
+      if (n_env) {
+        if (env[j] < 0) amp = MAX(env[j], MIN(0, amp));
+        else amp = MIN(env[j], MAX(0, amp));
+      }
+      if (osc->filter) {
+        out[j] = amp;
+        continue;
+      }
+      amp *= g0 + (g1 - g0) * (k * step);
+      if (osc->clip > 0 && fabs(amp) > osc->clip) {
+        amp = copysign(osc->clip, amp);
+      }
+      out[j] = amp;
+    }
+  }
+}
+
+// the oscillators of one level of a carrier's order depend only on
+// those of lower levels, so a pool of threads can compute them at once;
+// each thread claims the next oscillator of the level until none are
+// left, so a thread which finishes early picks up what the others have
+// not started; a level is only handed to the pool when it has enough
+// samples to compute to pay for waking it, so notes are rendered in
+// batches of blocks which together are that many samples long
+#define PARALLEL_MIN_WORK 4096
+
+static int render_threads = 1;
+
+struct tunebook_level {
+  struct tunebook_render_context *cx;
+  struct tunebook_instrument *instrument;
+  const int *order, *points;
+  int count, n_blocks, n_notes, beat_length;
+};
+
+struct tunebook_worker {
+  struct tunebook_pool *pool;
+  pthread_t thread;
+  double *work;
+};
+
+// the workers are woken to run a job on a task alongside the thread
+// which woke them: a level of oscillators, or a voice split into notes
+struct tunebook_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t wake, finished;
+  int n_workers, generation, running, quit;
+  void (* job)(void *task, double *work);
+  void *task;
+  struct tunebook_level level;
+  atomic_int next;
+  struct tunebook_worker *workers;
+};
+
+// the context for block b of a batch, whose output buffers and note
+// frequency are b banks along from the first block's
+struct tunebook_render_context *batch_block
+(struct tunebook_render_context *cx, struct tunebook_render_context *block,
+ struct tunebook_instrument *instrument, int b) {
+  int span = CHORD_LANES * control_period;
+  block->buffers = cx->buffers + b * instrument->n_oscillators * span;
+  block->freq = cx->freq + b * span;
+  return block;
+}
+
+// compute oscillators of the level being handed out until none are
+// left, each through every block of the batch in turn, so its filter
+// carries on from one block to the next
+void run_level(void *task, double *work) {
+  struct tunebook_pool *pool = task;
+  struct tunebook_level *level = &pool->level;
+  struct tunebook_render_context *cx = level->cx, block = *cx;
+  struct tunebook_filter_lanes lanes;
+  lanes.n = 0;
+  for (int t; (t = atomic_fetch_add(&pool->next, 1)) < level->count;) {
+    int o = level->order[t];
+    double started = cx->profile ? now() : 0;
+    for (int b = 0; b < level->n_blocks; ++b) {
+      int n = level->points[b + 1] - level->points[b];
+      render_oscillator(batch_block(cx, &block, level->instrument, b), level->instrument, o,
+                        level->points[b], n, level->n_notes, level->beat_length, work, &lanes);
+      if (lanes.n) run_filter_lanes(&lanes, n);
+    }
+    if (cx->profile) cx->osc_seconds[o] += now() - started;
+  }
+}
+
+void *pool_worker(void *arg) {
+  struct tunebook_worker *worker = arg;
+  struct tunebook_pool *pool = worker->pool;
+  int seen = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->generation == seen && !pool->quit) pthread_cond_wait(&pool->wake, &pool->lock);
+    if (pool->quit) break;
+    seen = pool->generation;
+    pthread_mutex_unlock(&pool->lock);
+    pool->job(pool->task, worker->work);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->running == 0) pthread_cond_signal(&pool->finished);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// hand a job to the pool, and work on it alongside until it is done
+void pool_go(struct tunebook_pool *pool, void (* job)(void *, double *), void *task, double *work) {
+  pthread_mutex_lock(&pool->lock);
+  pool->job = job;
+  pool->task = task;
+  pool->running = pool->n_workers;
+  pool->generation++;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  job(task, work);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->running) pthread_cond_wait(&pool->finished, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_run(struct tunebook_pool *pool, struct tunebook_level *level) {
+  pool->level = *level;
+  atomic_store(&pool->next, 0);
+  pool_go(pool, run_level, pool, level->cx->inputs);
+}
+
+// threads besides the main one leave signals to it, so that cancelling
+// interrupts whatever the main thread is waiting on
+void start_thread(pthread_t *thread, void *(* run)(void *), void *arg) {
+  sigset_t all, mask;
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, &mask);
+  pthread_create(thread, NULL, run, arg);
+  pthread_sigmask(SIG_SETMASK, &mask, NULL);
+}
+
+struct tunebook_pool *pool_start(int n_threads) {
+  struct tunebook_pool *pool;
+  NEW(pool, 1);
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->wake, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  pool->n_workers = n_threads - 1;
+  pool->generation = 0;
+  pool->running = 0;
+  pool->quit = 0;
+  noise(0);
+  NEW(pool->workers, pool->n_workers);
+  for (int w = 0; w < pool->n_workers; ++w) {
+    pool->workers[w].pool = pool;
+    NEW(pool->workers[w].work, 12 * CHORD_LANES * control_period);
+    start_thread(&pool->workers[w].thread, pool_worker, &pool->workers[w]);
+  }
+  return pool;
+}
+
+void pool_stop(struct tunebook_pool *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int w = 0; w < pool->n_workers; ++w) {
+    pthread_join(pool->workers[w].thread, NULL);
+    free(pool->workers[w].work);
+  }
+  free(pool->workers);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->wake);
+  pthread_cond_destroy(&pool->finished);
+  free(pool);
+}
+
+// compute every oscillator feeding the carrier, level by level, for
+// each of n_notes chord lanes over the n_blocks blocks from points[0]
+// up to points[n_blocks]; the carrier's output for each block is left
+// in its buffer of that block's bank
+void render_block
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument,
+ struct tunebook_oscillator *carrier, const int *points, int n_blocks,
+ int n_notes, int beat_length) {
+  struct tunebook_render_context block = *cx;
+  struct tunebook_filter_lanes lanes;
+  int n_points = points[n_blocks] - points[0];
+  lanes.n = 0;
+  // lfos grow their tables as they are read, which only this thread may do
+  for (int i = 0; i < carrier->n_order; ++i) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[carrier->order[i]];
+    if (osc->shape == OSC_BUS)
+      lfo_reserve(osc->lfo, cx->time + points[n_blocks] / osc->oversample);
+  }
+  for (int i = 0, count; i < carrier->n_order; i += count) {
+    int level = instrument->oscillators[carrier->order[i]].level;
+    int64_t work = 0;
+    for (count = 0; i + count < carrier->n_order; ++count) {
+      struct tunebook_oscillator *osc = &instrument->oscillators[carrier->order[i + count]];
+      if (osc->level != level) break;
+      if (!osc->control_rate) work += (int64_t)n_points * n_notes * osc->unison;
+    }
+    if (cx->pool && count > 1 && work >= PARALLEL_MIN_WORK) {
+      struct tunebook_level job = {
+        cx, instrument, carrier->order + i, points, count, n_blocks, n_notes, beat_length
+      };
+      pool_run(cx->pool, &job);
+      continue;
+    }
+    for (int b = 0; b < n_blocks; ++b) {
+      int n = points[b + 1] - points[b];
+      for (int c = 0; c < count; ++c) {
+        int o = carrier->order[i + c];
+        double started = cx->profile ? now() : 0;
+        render_oscillator(batch_block(cx, &block, instrument, b), instrument, o,
+                          points[b], n, n_notes, beat_length, cx->inputs, &lanes);
+        if (cx->profile) cx->osc_seconds[o] += now() - started;
+      }
+      if (lanes.n) run_filter_lanes(&lanes, n);
+    }
+  }
+}
+
+// instruments can be compiled ahead of time into C kernels with every
+// constant and route baked in; kernels are cached by the hash of their
+// source, so an unchanged instrument is only ever compiled once
+#define KERNEL_ABI 1
+#define KERNEL_CFLAGS "-O3 -shared -fPIC"
+
+typedef void (* kernel_fun)
+(int carrier, int point, int n, int beat_length, const double *freq,
+ double *buffers, int stride, const double *noise_table);
+
+static char *kernel_dir = NULL;
+
+static const char kernel_prelude[] =
+  "#include <math.h>\n"
+  "#include <stdlib.h>\n"
+  "#include <sys/param.h>\n"
+  "int tunebook_kernel_abi = %i;\n"
+  "static double square(double i) { return 2*(floor(sin(i)) + 0.5); }\n"
+  "static double saw(double i) { i *= .25; return (2 * (i - trunc(i))) - 1; }\n"
+  "static double triangle(double i) { return (2 * fabs(saw(i))) - 1; }\n"
+  "#define noise(i) noise_table[abs((int)(i)) %% %i]\n";
+
+const char *wave_name(struct tunebook_oscillator *osc) {
+  switch (osc->shape) {
+  case OSC_SAW: return "saw";
+  case OSC_TRIANGLE: return "triangle";
+  case OSC_SQUARE: return "square";
+  case OSC_NOISE: return "noise";
+  case OSC_SINE:
+  case OSC_HARMONICS:
+  case OSC_WAVETABLE:
+  case OSC_BUS: break;
+  }
+  return "sin";
+}
+
+void emit_envelope(FILE *src, struct tunebook_oscillator *osc, int o) {
+  fprintf(src,
+          "static double env_%i(int point, int beat_length) {\n"
+          "  int attack = %a * beat_length;\n"
+          "  int decay = attack + (%a * (double)beat_length);\n"
+          "  if (point < attack) return (double)point/attack;\n"
+          "  if (point < decay) {\n"
+          "    double q = (double)(point-attack)/(decay-attack);\n"
+          "    return 1 - (q * (1 - %a));\n"
+          "  }\n"
+          "  if (point < beat_length) return %a;\n"
+          "  int release_end = beat_length * %a;\n"
+          "  if (release_end <= 0) return 0;\n"
+          "  double q = (double)(point - beat_length)/release_end;\n"
+          "  return (1 - q) * %a;\n"
+          "}\n",
+          o, osc->attack, osc->decay, osc->sustain, osc->sustain,
+          osc->release, osc->sustain);
+}
+
+void emit_clip(FILE *src, struct tunebook_oscillator *osc) {
+  if (osc->clip > 0)
+    fprintf(src, "      if (fabs(amp) > %a) amp = copysign(%a, amp);\n", osc->clip, osc->clip);
+}
+
+// the generated arithmetic mirrors render_block operation for operation,
+// so a kernel renders exactly what the interpreter would
+void emit_carrier
+(FILE *src, struct tunebook_instrument *instrument, int c) {
+  static const char *kinds[] = { "am", "fm", "pm", "add", "sub", "env" };
+  struct tunebook_oscillator *carrier = &instrument->oscillators[c];
+  fprintf(src,
+          "static void carrier_%i\n"
+          "(int point, int n, int beat_length, const double *freq,\n"
+          " double *b, int stride, const double *noise_table) {\n"
+          "  int last = point + n - 1;\n"
+          "  double step = n > 1 ? 1.0 / (n - 1) : 0;\n", c);
+  for (int i = 0; i < carrier->n_order; ++i)
+    fprintf(src, "  double *o%i = b + %i * stride;\n", carrier->order[i], carrier->order[i]);
+  for (int i = 0; i < carrier->n_order; ++i) {
+    int o = carrier->order[i];
+    struct tunebook_oscillator *osc = &instrument->oscillators[o];
+    if (osc->control_rate) {
+      fprintf(src,
+              "  {\n"
+              "    double e[2];\n"
+              "    for (int j = 0; j < 2; ++j) {\n"
+              "      int at = j ? last : point;\n"
+              "      double amp = %a * %s(at * %a * 2 * M_PI / %i);\n"
+              "      amp *= env_%i(at, beat_length);\n",
+              osc->volume, wave_name(osc), osc->hz, SAMPLE_RATE * osc->oversample, o);
+      emit_clip(src, osc);
+      fprintf(src,
+              "      e[j] = amp;\n"
+              "    }\n"
+              "    for (int k = 0; k < n; ++k) o%i[k] = e[0] + (e[1] - e[0]) * (k * step);\n"
+              "  }\n", o);
+      continue;
+    }
+    fprintf(src,
+            "  {\n"
+            "    double g0 = env_%i(point, beat_length), g1 = env_%i(last, beat_length);\n"
+            "    for (int k = 0; k < n; ++k) {\n"
+            "      double am = 0, fm = 0, pm = 0, add = 0, sub = 0, env = 0;\n", o, o);
+    int n_env = 0;
+    for (int r = 0; r < osc->n_routes; ++r) {
+      if (osc->routes[r].kind == ROUTE_ENV) n_env++;
+      fprintf(src, "      %s += o%i[k];\n", kinds[osc->routes[r].kind], osc->routes[r].source);
+    }
+    if (osc->hz) fprintf(src, "      double f = %a;\n", osc->hz);
+    else fprintf(src, "      double f = freq[k] * %a;\n", osc->detune);
+    fprintf(src,
+            "      double amp = (1 + am) * %a * %s((point + k + pm) * (f * 1 + fm) * 2 * M_PI / %i);\n"
+            "      amp += add;\n"
+            "      amp -= sub;\n",
+            osc->volume, wave_name(osc), SAMPLE_RATE * osc->oversample);
+    if (n_env)
+      fprintf(src,
+              "      if (env < 0) amp = MAX(env, MIN(0, amp));\n"
+              "      else amp = MIN(env, MAX(0, amp));\n");
+    fprintf(src, "      amp *= g0 + (g1 - g0) * (k * step);\n");
+    emit_clip(src, osc);
+    fprintf(src,
+            "      o%i[k] = amp;\n"
+            "    }\n"
+            "  }\n", o);
+  }
+  fprintf(src, "}\n");
+}
+
+// only the plainest characters of a name are written into a kernel's
+// source, the rest as underscores, so that nothing a book says can end
+// up being compiled
+void emit_name(FILE *src, const char *name) {
+  for (; *name; ++name)
+    fputc(isalnum((unsigned char)*name) || strchr(" _-", *name) ? *name : '_', src);
+}
+
+void emit_kernel(FILE *src, struct tunebook_instrument *instrument) {
+  fprintf(src, "// instrument \"");
+  emit_name(src, instrument->name);
+  fprintf(src, "\"\n");
+  fprintf(src, kernel_prelude, KERNEL_ABI, MAX_NOISE_STEPS);
+  for (int o = 0; o < instrument->n_oscillators; ++o)
+    emit_envelope(src, &instrument->oscillators[o], o);
+  for (int o = 0; o < instrument->n_oscillators; ++o)
+    if (!instrument->oscillators[o].modulator) emit_carrier(src, instrument, o);
+  fprintf(src,
+          "void tunebook_kernel\n"
+          "(int carrier, int point, int n, int beat_length, const double *freq,\n"
+          " double *buffers, int stride, const double *noise_table) {\n"
+          "  switch (carrier) {\n");
+  for (int o = 0; o < instrument->n_oscillators; ++o)
+    if (!instrument->oscillators[o].modulator)
+      fprintf(src,
+              "  case %i:\n"
+              "    carrier_%i(point, n, beat_length, freq, buffers, stride, noise_table);\n"
+              "    break;\n", o, o);
+  fprintf(src, "  }\n}\n");
+}
+
+// returns the instrument's kernel, building it if it is not cached yet,
+// or NULL when no kernel can be had and the interpreter must be used
+kernel_fun tunebook_load_kernel(struct tunebook_instrument *instrument) {
+  char *source, path[PATH_MAX], source_path[PATH_MAX], temp_path[PATH_MAX],
+    command[3 * PATH_MAX];
+  size_t n_source;
+  const char *cc = getenv("CC");
+  // filters, harmonics, wavetables, buses and unison are only ever
+  // interpreted
+  for (int o = 0; o < instrument->n_oscillators; ++o) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[o];
+    if (osc->filter || osc->shape == OSC_HARMONICS || osc->shape == OSC_WAVETABLE
+        || osc->shape == OSC_BUS || osc->unison > 1) return NULL;
+    for (int r = 0; r < osc->n_routes; ++r)
+      if (osc->routes[r].kind == ROUTE_CUTOFF) return NULL;
+  }
+  FILE *src = open_memstream(&source, &n_source);
+  emit_kernel(src, instrument);
+  fclose(src);
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, source, n_source);
+  snprintf(path, sizeof path, "%s/tunebook-%016llx.so", kernel_dir, (unsigned long long)hash);
+  if (access(path, R_OK)) {
+    snprintf(source_path, sizeof source_path, "%s/tunebook-%016llx.c",
+             kernel_dir, (unsigned long long)hash);
+    snprintf(temp_path, sizeof temp_path, "%s/tunebook-%016llx.%i.so",
+             kernel_dir, (unsigned long long)hash, (int)getpid());
+    src = fopen(source_path, "w");
+    if (!src || fwrite(source, n_source, 1, src) != 1 || fclose(src)) {
+      free(source);
+      return NULL;
+    }
+    snprintf(command, sizeof command, "%s " KERNEL_CFLAGS " -o '%s' '%s' -lm",
+             cc ? cc : "cc", temp_path, source_path);
+    if (system(command) || rename(temp_path, path)) {
+      unlink(temp_path);
+      free(source);
+      return NULL;
+    }
+  }
+  free(source);
+  void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!handle) return NULL;
+  int *abi = dlsym(handle, "tunebook_kernel_abi");
+  kernel_fun kernel = dlsym(handle, "tunebook_kernel");
+  if (!abi || *abi != KERNEL_ABI || !kernel) {
+    dlclose(handle);
+    return NULL;
+  }
+  return kernel;
+}
+
+// make sure the song buffer covers the window up to the given time
+void reserve_samples(struct tunebook_render_context *cx, long time) {
+  long needed = MIN(time, cx->to) - cx->from;
+  if (needed <= cx->n_samples) return;
+  if (needed > cx->s_samples) {
+    cx->s_samples = MAX(needed, 2 * cx->s_samples);
+    RESIZE(cx->samples, cx->s_samples);
+  }
+  memset(cx->samples + cx->n_samples, 0, (needed - cx->n_samples) * sizeof *cx->samples);
+  cx->n_samples = needed;
+}
+
+// whether the voice being rendered should stop, as the book has been
+// cancelled or has run out of time, or has gone past one of its limits;
+// a dry run is how a book's cost is found out, so it is only ever
+// cancelled. the first reason is kept, and said once
+int halted(struct tunebook_render_context *cx) {
+  if (cx->halted) return 1;
+  int reason = atomic_load(&cancelled), v = cx->voice - cx->song->voices + 1;
+  long samples = MIN(cx->end, cx->to) - cx->from;
+  if (reason == ERROR_DEADLINE)
+    fprintf(stderr, "%s ran out of its %g seconds\n", cx->song->name, limits.seconds);
+  else if (reason) fprintf(stderr, "%s was cancelled\n", cx->song->name);
+  else if (cx->dry) return 0;
+  else if (limits.samples && samples > limits.samples) {
+    fprintf(stderr, "voice %i of %s is longer than %li samples\n", v, cx->song->name,
+            limits.samples);
+    reason = ERROR_LIMIT;
+  } else if (limits.evaluations && cx->spent + cx->evaluations > limits.evaluations) {
+    fprintf(stderr, "%s takes more than %lli oscillator evaluations\n", cx->song->name,
+            (long long)limits.evaluations);
+    reason = ERROR_LIMIT;
+  } else if (limits.memory && (int64_t)samples * cx->frame_bytes
+             + (int64_t)cx->s_scheduled * sizeof *cx->notes > limits.memory) {
+    fprintf(stderr, "voice %i of %s needs more than %lli bytes\n", v, cx->song->name,
+            (long long)limits.memory);
+    reason = ERROR_LIMIT;
+  }
+  cx->halted = reason;
+  return reason != 0;
+}
+
+// how many times oscillators are evaluated to render n samples of a
+// note; control rate oscillators are only evaluated twice a period
+int64_t osc_evaluations(struct tunebook_oscillator *osc, int n) {
+  n *= osc->oversample;
+  if (osc->control_rate) return 2 * ((n + control_period - 1) / control_period);
+  return (int64_t)n * osc->unison;
+}
+
+int64_t note_evaluations
+(struct tunebook_instrument *instrument, struct tunebook_oscillator *carrier, int n) {
+  int64_t evaluations = 0;
+  for (int i = 0; i < carrier->n_order; ++i)
+    evaluations += osc_evaluations(&instrument->oscillators[carrier->order[i]], n);
+  return evaluations;
+}
+
+// find the entry for the given key, adding it if there is none yet
+struct tunebook_profile_entry *profile_entry
+(struct tunebook_profile_table *table, const char *key) {
+  struct tunebook_profile_entry *entry;
+  if (2 * (table->n_entries + 1) > table->s_entries) {
+    struct tunebook_profile_table grown = { 0, MAX(64, 2 * table->s_entries) };
+    grown.entries = calloc(grown.s_entries, sizeof *grown.entries);
+    for (int e = 0; e < table->s_entries; ++e) {
+      if (!table->entries[e].key) continue;
+      entry = profile_entry(&grown, table->entries[e].key);
+      free(entry->key);
+      *entry = table->entries[e];
+    }
+    free(table->entries);
+    *table = grown;
+  }
+  uint64_t hash = fnv1a(0xcbf29ce484222325ULL, key, strlen(key));
+  for (int e = hash % table->s_entries;; e = (e + 1) % table->s_entries) {
+    entry = &table->entries[e];
+    if (!entry->key) break;
+    if (!strcmp(entry->key, key)) return entry;
+  }
+  entry->key = strdup(key);
+  table->n_entries++;
+  return entry;
+}
+
+void profile_add
+(struct tunebook_profile_table *table, const char *key,
+ long plays, int64_t evaluations, double seconds) {
+  struct tunebook_profile_entry *entry = profile_entry(table, key);
+  entry->plays += plays;
+  entry->evaluations += evaluations;
+  entry->seconds += seconds;
+}
+
+// append a frame to a folded stack, keeping names clear of the separator
+int profile_frame(char *stack, int n, int size, const char *frame) {
+  if (n && n < size - 1) stack[n++] = ';';
+  for (; *frame && n < size - 1; ++frame) stack[n++] = *frame == ';' ? ':' : *frame;
+  stack[n] = 0;
+  return n;
+}
+
+// the stack a note was played from, outermost first: the song, the
+// voice, every repeat it is inside of and the note itself
+int profile_stack(struct tunebook_render_context *cx, char *stack, int size) {
+  char frame[1024];
+  int n = profile_frame(stack, 0, size, cx->song->name);
+  snprintf(frame, sizeof frame, "voice %i %s",
+           (int)(cx->voice - cx->song->voices) + 1, cx->voice->instrument);
+  n = profile_frame(stack, n, size, frame);
+  for (int r = 0; r < cx->n_repeats; ++r) {
+    snprintf(frame, sizeof frame, "%s:%i repeat", cx->voice->source,
+             cx->voice->lines[cx->repeats[r]]);
+    n = profile_frame(stack, n, size, frame);
+  }
+  snprintf(frame, sizeof frame, "%s:%i", cx->voice->source, cx->voice->lines[cx->command]);
+  return profile_frame(stack, n, size, frame);
+}
+
+// charge the notes played together on one carrier to their line, the
+// repeats around it, their instrument and oscillators, and their stack
+void profile_note
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument,
+ struct tunebook_oscillator *carrier, int n, int n_notes, double seconds) {
+  struct tunebook_profile *profile = cx->profile;
+  char key[1024], stack[4096];
+  int64_t evaluations = n_notes * note_evaluations(instrument, carrier, n);
+  profile->seconds += seconds;
+  profile->evaluations += evaluations;
+  snprintf(key, sizeof key, "%s:%i", cx->voice->source, cx->voice->lines[cx->command]);
+  profile_add(&profile->lines, key, n_notes, evaluations, seconds);
+  for (int r = 0; r < cx->n_repeats; ++r) {
+    snprintf(key, sizeof key, "%s:%i repeat", cx->voice->source,
+             cx->voice->lines[cx->repeats[r]]);
+    profile_add(&profile->lines, key, n_notes, evaluations, seconds);
+  }
+  profile_add(&profile->instruments, instrument->name, n_notes, evaluations, seconds);
+  int n_stack = profile_stack(cx, stack, sizeof stack);
+  if (instrument->kernel) {
+    profile_frame(stack, n_stack, sizeof stack, "kernel");
+    profile_add(&profile->stacks, stack, n_notes, evaluations, seconds);
+  }
+  for (int i = 0; i < carrier->n_order; ++i) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[carrier->order[i]];
+    double osc_seconds = cx->osc_seconds[carrier->order[i]];
+    cx->osc_seconds[carrier->order[i]] = 0;
+    snprintf(key, sizeof key, "%s/%s", instrument->name, osc->name);
+    profile_add(&profile->oscillators, key, n_notes, n_notes * osc_evaluations(osc, n), osc_seconds);
+    if (instrument->kernel) continue;
+    profile_frame(stack, n_stack, sizeof stack, osc->name);
+    profile_add(&profile->stacks, stack, n_notes, n_notes * osc_evaluations(osc, n), osc_seconds);
+  }
+}
+
+void schedule_note
+(struct tunebook_render_context *cx, int beat_length, int length, int legato_end,
+ const double *prev_freq, const double *targ_freq, int carrier, int n_notes) {
+  if (cx->n_scheduled >= cx->s_scheduled) {
+    cx->s_scheduled = MAX(64, 2 * cx->s_scheduled);
+    RESIZE(cx->notes, cx->s_scheduled);
+  }
+  struct tunebook_note *note = &cx->notes[cx->n_scheduled++];
+  note->time = cx->time;
+  note->beat_length = beat_length;
+  note->length = length;
+  note->legato_end = legato_end;
+  note->carrier = carrier;
+  note->n_notes = n_notes;
+  note->root = cx->root;
+  for (int l = 0; l < n_notes; ++l) {
+    note->stop[l] = length;
+    note->prev_freq[l] = prev_freq[l];
+    note->targ_freq[l] = targ_freq[l];
+  }
+}
+
+// give every scheduled note the point where each of its lanes stops:
+// when a note starts with the voice already sounding as many notes as
+// it may, the quietest of them, or the oldest of the quietest, is stolen;
+// a note still in its attack counts as being as loud as it will get, so
+// that a chord does not steal its own notes as they start
+void steal_notes
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument, int polyphony) {
+  long *sounding;
+  int n_sounding = 0;
+  NEW(sounding, polyphony);
+  for (long s = 0; s < cx->n_scheduled; ++s) {
+    struct tunebook_note *note = &cx->notes[s];
+    for (int l = 0; l < note->n_notes; ++l) {
+      int kept = 0, victim = 0;
+      double quietest = INFINITY;
+      for (int a = 0; a < n_sounding; ++a) {
+        struct tunebook_note *other = &cx->notes[sounding[a] / CHORD_LANES];
+        if (other->time + other->stop[sounding[a] % CHORD_LANES] > note->time)
+          sounding[kept++] = sounding[a];
+      }
+      n_sounding = kept;
+      if (n_sounding == polyphony) {
+        for (int a = 0; a < n_sounding; ++a) {
+          struct tunebook_note *other = &cx->notes[sounding[a] / CHORD_LANES];
+          struct tunebook_oscillator *carrier = &instrument->oscillators[other->carrier];
+          int point = note->time - other->time;
+          double level = carrier->peak * (point < carrier->attack * other->beat_length
+                                          ? 1 : envelope_at(carrier, point, other->beat_length));
+          if (level < quietest) {
+            quietest = level;
+            victim = a;
+          }
+        }
+        struct tunebook_note *stolen = &cx->notes[sounding[victim] / CHORD_LANES];
+        stolen->stop[sounding[victim] % CHORD_LANES] = note->time - stolen->time;
+        memmove(sounding + victim, sounding + victim + 1,
+                (n_sounding - victim - 1) * sizeof *sounding);
+        --n_sounding;
+      }
+      sounding[n_sounding++] = s * CHORD_LANES + l;
+    }
+  }
+  free(sounding);
+}
+
+// where rendering a note from point first on has to begin: blocks fall
+// on the note's own grid, from its start up to its end, so that a note
+// rendered from partway through sounds just as it does whole; a filter
+// carries on from sample to sample, so a note with one is rendered from
+// its start
+int note_start
+(struct tunebook_instrument *instrument, struct tunebook_oscillator *carrier,
+ int first, int end, int beat_length, int legato_end) {
+  int i = 0;
+  for (int o = 0; o < carrier->n_order; ++o)
+    if (instrument->oscillators[carrier->order[o]].filter) return 0;
+  for (int next; (next = next_breakpoint(instrument, carrier, i, MIN(i + control_period, end),
+                                         beat_length, legato_end)) <= first;) i = next;
+  return i;
+}
+
+// the blocks of the note's grid from point i on, up to the first which
+// reaches last: each is at most a control period long and stops at the
+// carrier's breakpoints and at the note's end, and there are as many as
+// a batch holds; points is left with where each block starts and where
+// the last one ends, and the number of blocks is returned
+int plan_blocks
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument,
+ struct tunebook_oscillator *carrier, int i, int end, int last,
+ int beat_length, int legato_end) {
+  int n_blocks = 0;
+  cx->points[0] = i;
+  while (n_blocks < cx->n_batch && i < last) {
+    i = next_breakpoint(instrument, carrier, i, MIN(i + control_period, end),
+                        beat_length, legato_end);
+    cx->points[++n_blocks] = i;
+  }
+  return n_blocks;
+}
+
+// compute the n_blocks blocks of points planned for n_notes notes on the
+// same carrier, each lane gliding between its own frequencies; the
+// carrier's output for each block is left in its buffer of that block's
+// bank
+void render_points
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument, int osc_i,
+ int n_blocks, int beat_length, int legato_end, const double *prev_freq,
+ const double *targ_freq, int n_notes) {
+  int span = CHORD_LANES * control_period, bank = instrument->n_oscillators * span;
+  for (int b = 0; b < n_blocks; ++b) {
+    int i = cx->points[b], end = cx->points[b + 1], n = end - i;
+    double step = n > 1 ? 1.0 / (n - 1) : 0, *freq = cx->freq + b * span;
+    for (int l = 0; l < n_notes; ++l) {
+      double f0 = glide_at(i, legato_end, prev_freq[l], targ_freq[l]);
+      double f1 = glide_at(end - 1, legato_end, prev_freq[l], targ_freq[l]);
+      for (int k = 0; k < n; ++k) freq[l * n + k] = f0 + (f1 - f0) * (k * step);
+    }
+    // kernels take one lane at a time, writing it where the interpreter would
+    if (instrument->kernel)
+      for (int l = 0; l < n_notes; ++l)
+        instrument->kernel(osc_i, i, n, beat_length, freq + l * n,
+                           cx->buffers + b * bank + l * n, span, noise_buffer);
+  }
+  if (!instrument->kernel)
+    render_block(cx, instrument, &instrument->oscillators[osc_i], cx->points, n_blocks,
+                 n_notes, beat_length);
+}
+
+// an oversampled note is rendered at the higher rate into a window of
+// each lane, from far enough before its first sample for the filter to
+// reach back over; each sample of output is made once the window reaches
+// far enough past it, or at the end of the note, past which is silence
+void render_oversampled
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument, int osc_i,
+ int beat_length, int legato_end, const double *prev_freq, const double *targ_freq,
+ int n_notes, const int *stop, int end, int first, int last, float *samples) {
+  int span = CHORD_LANES * control_period, over = instrument->oversample;
+  int reach = DECIMATE_REACH * over, n_taps = 2 * reach + 1;
+  int s_window = oversample_window(instrument);
+  const double *taps = decimate_taps[over];
+  struct tunebook_oscillator *carrier = &instrument->oscillators[osc_i];
+  int start = MAX(0, first * over - reach), n_window = 0, t = first;
+  int end_point = MIN(end * over, last * over + reach);
+  int i = note_start(instrument, carrier, start, end * over, beat_length * over, legato_end * over);
+  memset(cx->filters, 0, 2 * CHORD_LANES * instrument->n_oscillators * sizeof *cx->filters);
+  for (int b = 0, n_blocks = 0; i < end_point && !atomic_load(&cancelled); ++b) {
+    if (b == n_blocks) {
+      n_blocks = plan_blocks(cx, instrument, carrier, i, end * over, end_point,
+                             beat_length * over, legato_end * over);
+      render_points(cx, instrument, osc_i, n_blocks, beat_length * over, legato_end * over,
+                    prev_freq, targ_freq, n_notes);
+      b = 0;
+    }
+    // a block can begin before the window does, and the window runs on
+    // past the last sample for as far as the filter reaches, as it would
+    // for the whole note
+    int next = cx->points[b + 1], skip = MAX(0, start - i), n = next - i - skip;
+    const double *out = cx->buffers + (b * instrument->n_oscillators + osc_i) * span;
+    if (n > 0)
+      for (int l = 0; l < n_notes; ++l)
+        memcpy(cx->window + l * s_window + n_window, out + l * (next - i) + skip,
+               n * sizeof *out);
+    n_window += MAX(0, n);
+    i = next;
+    for (; t < last && (i >= end_point || t * over + reach < i); ++t) {
+      // the window holds from the tap at `from` on
+      int from = t * over - reach - start;
+      int lo = MAX(0, -from), hi = MIN(n_taps, n_window - from);
+      for (int l = 0; l < n_notes; ++l) {
+        const double *x = cx->window + l * s_window;
+        double amp = 0;
+        for (int j = lo; j < hi; ++j) amp += taps[j] * x[from + j];
+        if (amp > 1) amp = 1;
+        if (amp < -1) amp = -1;
+        if (t >= stop[l]) amp *= MAX(0, 1 - (double)(t - stop[l]) / STEAL_FADE);
+        samples[t] += amp;
+      }
+    }
+    int drop = t * over - reach - start;
+    if (drop > 0) {
+      for (int l = 0; l < n_notes; ++l)
+        memmove(cx->window + l * s_window, cx->window + l * s_window + drop,
+                (n_window - drop) * sizeof *cx->window);
+      n_window -= drop;
+      start += drop;
+    }
+  }
+}
+
+// render points first to last of n_notes notes on the same carrier,
+// which are end points long, into samples, which start where the notes
+// do, fading out each lane from where it stops
+void render_note
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument, int osc_i,
+ int beat_length, int legato_end, const double *prev_freq, const double *targ_freq,
+ int n_notes, const int *stop, int end, int first, int last, float *samples) {
+  int span = CHORD_LANES * control_period;
+  struct tunebook_oscillator *carrier = &instrument->oscillators[osc_i];
+  if (instrument->oversample > 1) {
+    render_oversampled(cx, instrument, osc_i, beat_length, legato_end, prev_freq, targ_freq,
+                       n_notes, stop, end, first, last, samples);
+    return;
+  }
+  memset(cx->filters, 0, 2 * CHORD_LANES * instrument->n_oscillators * sizeof *cx->filters);
+  int i = note_start(instrument, carrier, first, end, beat_length, legato_end);
+  for (int b = 0, n_blocks = 0; i < last && !atomic_load(&cancelled); ++b) {
+    if (b == n_blocks) {
+      n_blocks = plan_blocks(cx, instrument, carrier, i, end, last, beat_length, legato_end);
+      render_points(cx, instrument, osc_i, n_blocks, beat_length, legato_end,
+                    prev_freq, targ_freq, n_notes);
+      b = 0;
+    }
+    int next = cx->points[b + 1], n = next - i;
+    const double *out = cx->buffers + (b * instrument->n_oscillators + osc_i) * span;
+    for (int k = MAX(0, first - i); k < MIN(n, last - i); ++k) {
+      for (int l = 0; l < n_notes; ++l) {
+        double amp = out[l * n + k];
+        if (amp > 1) amp = 1;
+        if (amp < -1) amp = -1;
+        if (i + k >= stop[l]) amp *= MAX(0, 1 - (double)(i + k - stop[l]) / STEAL_FADE);
+        samples[i + k] += amp;
+      }
+    }
+    i = next;
+  }
+}
+
+// the part of a scheduled note within the render window, after it has
+// been cut short by any note stealing from it
+void clip_note(struct tunebook_render_context *cx, struct tunebook_note *note) {
+  int length = 0;
+  for (int l = 0; l < note->n_notes; ++l)
+    length = MAX(length, MIN(note->length, note->stop[l] + STEAL_FADE));
+  note->end = length;
+  note->first = MIN(length, MAX(0, cx->from - note->time));
+  note->last = MIN(length, cx->to - note->time);
+}
+
+// render the part of n_notes notes on the same carrier, starting at the
+// current time, which falls within the render window; each note is a
+// lane gliding between its own frequencies
+void write_note
+(struct tunebook_render_context *cx, int beat_length,
+ double legato, const double *prev_freq, const double *targ_freq, int n_notes,
+ struct tunebook_instrument *instrument, int osc_i) {
+  int stop[CHORD_LANES];
+  struct tunebook_oscillator *carrier = &instrument->oscillators[osc_i];
+  int length = MAX(0, MIN(beat_length * (1 + carrier->release), MAX_NOTE_LENGTH));
+  int legato_end = MAX(0, MIN(floor(beat_length * legato), MAX_NOTE_LENGTH));
+  cx->end = MAX(cx->end, cx->time + length);
+  if (halted(cx)) return;
+  length = audible_length(carrier, beat_length, length);
+  if (cx->scheduling) {
+    schedule_note(cx, beat_length, length, legato_end, prev_freq, targ_freq, osc_i, n_notes);
+    return;
+  }
+  for (int l = 0; l < n_notes; ++l) stop[l] = length;
+  if (cx->voice->polyphony) {
+    struct tunebook_note *note = &cx->notes[cx->n_played++];
+    length = 0;
+    for (int l = 0; l < n_notes; ++l) {
+      stop[l] = note->stop[l];
+      length = MAX(length, MIN(note->length, stop[l] + STEAL_FADE));
+    }
+  }
+  int first = MIN(length, MAX(0, cx->from - cx->time));
+  int last = MIN(length, cx->to - cx->time);
+  if (first >= last) return;
+  cx->n_notes += n_notes;
+  cx->evaluations += n_notes * note_evaluations(instrument, carrier, last - first);
+  if (cx->dry || halted(cx)) return;
+  double started = cx->profile ? now() : 0;
+  reserve_samples(cx, cx->time + last);
+  render_note(cx, instrument, osc_i, beat_length, legato_end, prev_freq, targ_freq, n_notes,
+              stop, length, first, last, cx->samples + (cx->time - cx->from));
+  if (cx->profile)
+    profile_note(cx, instrument, carrier, last - first, n_notes, now() - started);
+}
+
+// a voice can be split into its scheduled notes, which are independent
+// once each one's start and frequencies are known: they are rendered a
+// chunk at a time by whichever thread claims the chunk next, each chunk
+// into a tile of the song of its own; finished tiles are added into the
+// song in chunk order, so the sum does not depend on how many threads
+// there are or which of them rendered what
+#define SPLIT_CHUNK 32
+
+static int split_notes = 0;
+
+struct tunebook_chunk {
+  long first_note, end_note, from, to;
+  float *tile;
+  int done;
+};
+
+struct tunebook_split {
+  struct tunebook_render_context *cx;
+  struct tunebook_instrument *instrument;
+  int n_chunks, merged;
+  struct tunebook_chunk *chunks;
+  atomic_int next;
+  pthread_mutex_t lock;
+};
+
+// render chunks until none are left, each thread with scratch space
+// of its own, and add in every tile which is next in order
+void run_split(void *task, double *work) {
+  struct tunebook_split *split = task;
+  struct tunebook_instrument *instrument = split->instrument;
+  struct tunebook_render_context local = *split->cx, *cx = split->cx;
+  int span = CHORD_LANES * control_period;
+  local.profile = NULL;
+  local.pool = NULL;
+  NEW(local.buffers, instrument->n_oscillators * span);
+  NEW(local.inputs, 13 * span);
+  local.freq = local.inputs + 12 * span;
+  local.n_batch = 1;
+  NEW(local.points, 2);
+  NEW(local.filters, 2 * CHORD_LANES * instrument->n_oscillators);
+  NEW(local.window, CHORD_LANES * oversample_window(instrument));
+  for (int c; (c = atomic_fetch_add(&split->next, 1)) < split->n_chunks;) {
+    struct tunebook_chunk *chunk = &split->chunks[c];
+    chunk->tile = calloc(chunk->to - chunk->from, sizeof *chunk->tile);
+    for (long s = chunk->first_note; s < chunk->end_note; ++s) {
+      struct tunebook_note *note = &cx->notes[s];
+      if (note->first >= note->last) continue;
+      local.time = note->time;
+      local.root = note->root;
+      render_note(&local, instrument, note->carrier, note->beat_length, note->legato_end,
+                  note->prev_freq, note->targ_freq, note->n_notes, note->stop,
+                  note->end, note->first, note->last, chunk->tile + (note->time - chunk->from));
+    }
+    pthread_mutex_lock(&split->lock);
+    chunk->done = 1;
+    for (; split->merged < split->n_chunks && split->chunks[split->merged].done; ++split->merged) {
+      struct tunebook_chunk *next = &split->chunks[split->merged];
+      float *samples = cx->samples + (next->from - cx->from);
+      for (long i = 0; i < next->to - next->from; ++i) samples[i] += next->tile[i];
+      free(next->tile);
+    }
+    pthread_mutex_unlock(&split->lock);
+  }
+  free(local.buffers);
+  free(local.inputs);
+  free(local.points);
+  free(local.filters);
+  free(local.window);
+}
+
+// render the notes scheduled for a voice, split into chunks across the
+// pool if there is one
+void render_split(struct tunebook_render_context *cx, struct tunebook_instrument *instrument) {
+  struct tunebook_split split = { cx, instrument, 0, 0 };
+  long end = cx->from;
+  NEW(split.chunks, (cx->n_scheduled + SPLIT_CHUNK - 1) / SPLIT_CHUNK);
+  for (long s = 0; s < cx->n_scheduled; s += SPLIT_CHUNK) {
+    struct tunebook_chunk *chunk = &split.chunks[split.n_chunks++];
+    chunk->first_note = s;
+    chunk->end_note = MIN(s + SPLIT_CHUNK, cx->n_scheduled);
+    chunk->from = LONG_MAX;
+    chunk->to = chunk->done = 0;
+    for (long t = s; t < chunk->end_note; ++t) {
+      struct tunebook_note *note = &cx->notes[t];
+      clip_note(cx, note);
+      if (note->first >= note->last) continue;
+      cx->n_notes += note->n_notes;
+      cx->evaluations += note->n_notes * note_evaluations
+        (instrument, &instrument->oscillators[note->carrier], note->last - note->first);
+      chunk->from = MIN(chunk->from, note->time + note->first);
+      chunk->to = MAX(chunk->to, note->time + note->last);
+    }
+    if (chunk->from > chunk->to) chunk->from = chunk->to = cx->from;
+    end = MAX(end, chunk->to);
+  }
+  if (halted(cx)) {
+    free(split.chunks);
+    return;
+  }
+  reserve_samples(cx, end);
+  // lfos are worked out up front, as no thread but this one may grow them
+  for (int o = 0; o < instrument->n_oscillators; ++o)
+    if (instrument->oscillators[o].shape == OSC_BUS)
+      lfo_reserve(instrument->oscillators[o].lfo, end + control_period);
+  atomic_store(&split.next, 0);
+  pthread_mutex_init(&split.lock, NULL);
+  if (cx->pool) pool_go(cx->pool, run_split, &split, NULL);
+  else run_split(&split, NULL);
+  pthread_mutex_destroy(&split.lock);
+  free(split.chunks);
+}
+
+double previous_frequency(struct tunebook_render_context *cx, int chord_n) {
+  // TODO handle base/modulate/other commands that change our basis
+  struct tunebook_voice *voice = cx->voice;
+  if (cx->last_freq_command < 0) return 0;
+  uint32_t operand = voice->operands[cx->last_freq_command];
+  switch (voice->ops[cx->last_freq_command]) {
+  case VOICE_COMMAND_CHORD:
+    if (chord_n >= voice->notes[operand]) return 0;
+    return cx->root * number_to_double(cx->base, unpack_number(voice, voice->notes[operand + 1 + chord_n]));
+  case VOICE_COMMAND_NOTE:
+    return cx->root * number_to_double(cx->base, unpack_number(voice, operand));
+  default:
+    return 0;
+  }
+}
+
+// how far the groove stretches the given beat
+double groove_at(struct tunebook_render_context *cx, long beat) {
+  return number_to_double(1, unpack_number(cx->voice, cx->groove[1 + beat % cx->groove[0]]));
+}
+
+// how many samples a beat at the given tempo lasts, stretched; any
+// tempo or stretch at all comes out as a length a note can have
+int beat_samples(double tempo, double stretch) {
+  double length = SAMPLE_RATE * 60 / tempo;
+  if (!(length > 0)) return 0;
+  length = (int)MIN(length, MAX_NOTE_LENGTH) * stretch;
+  return length > 0 ? MIN(length, MAX_NOTE_LENGTH) : 0;
+}
+
+double groove_stretch(struct tunebook_render_context *cx, long beat) {
+  return cx->groove && cx->groove[0] > 0 ? groove_at(cx, beat) : 1;
+}
+
+void process_command
+(struct tunebook_render_context *cx,
+ struct tunebook_instrument *instrument,
+ struct tunebook_voice *voice,
+ int command_i) {
+  int length, current_repeat, n_notes, *carriers;
+  double count;
+  uint32_t operand = voice->operands[command_i];
+  const uint32_t *notes;
+  cx->command = command_i;
+  switch (voice->ops[command_i]) {
+  case VOICE_COMMAND_BASE:
+    cx->base = number_to_double(cx->base, unpack_number(voice, operand));
+    break;
+  case VOICE_COMMAND_LEGATO:
+    cx->legato = number_to_double(cx->base, unpack_number(voice, operand));
+    break;
+  case VOICE_COMMAND_MODULATE:
+    cx->root *= number_to_double(cx->base, unpack_number(voice, operand));
+    break;
+  case VOICE_COMMAND_GROOVE:
+    cx->groove = &voice->notes[operand];
+    cx->beat = 0;
+    break;
+  case VOICE_COMMAND_SECTION:
+    if (++cx->n_sections >= cx->s_sections) {
+      cx->s_sections *= 2;
+      RESIZE(cx->sections, cx->s_sections);
+    }
+    cx->sections[cx->n_sections-1] = command_i;
+    break;
+  case VOICE_COMMAND_REPEAT:
+    current_repeat = cx->sections[--cx->n_sections]+1;
+    if (++cx->n_repeats >= cx->s_repeats) {
+      cx->s_repeats *= 2;
+      RESIZE(cx->repeats, cx->s_repeats);
+    }
+    cx->repeats[cx->n_repeats-1] = command_i;
+    count = floor(number_to_double(cx->base, unpack_number(voice, operand)));
+    for (int repeat_i = count > 0 ? MIN(count, INT_MAX) : 0; repeat_i > 0; --repeat_i)
+      for (int r = current_repeat; r < command_i; ++r) {
+        if (cx->time >= cx->to || halted(cx)) goto repeated;
+	process_command(cx, instrument, voice, r);
+      }
+  repeated:
+    --cx->n_repeats;
+    break;
+  case VOICE_COMMAND_CHORD:
+    length = beat_samples(cx->tempo, groove_stretch(cx, cx->beat));
+    n_notes = voice->notes[operand];
+    notes = &voice->notes[operand + 1];
+    // notes take the carriers in turn, and those which share a carrier
+    // are written together, a lane each
+    NEW(carriers, n_notes);
+    for (int n = 0; n < n_notes; ++n) {
+      while (is_modulator(instrument, cx->osc % instrument->n_oscillators)) ++cx->osc;
+      carriers[n] = cx->osc++ % instrument->n_oscillators;
+    }
+    for (int n = 0; n < n_notes; ++n) {
+      double prev_freq[CHORD_LANES], targ_freq[CHORD_LANES];
+      int carrier = carriers[n], n_lanes = 0;
+      if (carrier < 0) continue;
+      for (int m = n; m < n_notes; ++m) {
+        if (carriers[m] != carrier) continue;
+        carriers[m] = -1;
+        prev_freq[n_lanes] = previous_frequency(cx, m);
+        targ_freq[n_lanes] = cx->root * number_to_double(cx->base, unpack_number(voice, notes[m]));
+        if (++n_lanes == CHORD_LANES) {
+          write_note(cx, length, cx->legato, prev_freq, targ_freq, n_lanes, instrument, carrier);
+          n_lanes = 0;
+        }
+      }
+      if (n_lanes)
+        write_note(cx, length, cx->legato, prev_freq, targ_freq, n_lanes, instrument, carrier);
+    }
+    free(carriers);
+    ++cx->beat;
+    ++cx->n_chords;
+    cx->last_freq_command = command_i;
+    cx->time += length;
+    break;
+  case VOICE_COMMAND_NOTE:
+    length = beat_samples(cx->tempo, groove_stretch(cx, cx->beat++));
+    double prev_freq = previous_frequency(cx, 0);
+    double targ_freq = cx->root * number_to_double(cx->base, unpack_number(voice, operand));
+    while (is_modulator(instrument, cx->osc % instrument->n_oscillators)) ++cx->osc;
+    write_note(cx, length, cx->legato, &prev_freq, &targ_freq, 1,
+               instrument, cx->osc % instrument->n_oscillators);
+    ++cx->osc;
+    cx->last_freq_command = command_i;
+    cx->time += length;
+    break;
+  case VOICE_COMMAND_REST:
+    length = beat_samples(cx->tempo, groove_stretch(cx, cx->beat++));
+    cx->time += length;
+    cx->end = MAX(cx->end, cx->time);
+    break;
+  }
+}
+
+// a point in a song given on the command line, in beats or seconds
+struct tunebook_time {
+  double value;
+  int seconds;
+};
+
+static struct tunebook_time render_from = { 0, 0 }, render_to = { -1, 0 };
+
+long time_to_samples(struct tunebook_time time, double tempo) {
+  double samples = time.value * SAMPLE_RATE;
+  if (!time.seconds) samples = samples * 60 / tempo;
+  if (time.value < 0 || samples >= LONG_MAX) return LONG_MAX;
+  return samples > 0 ? samples : 0;
+}
+
+int parse_time(const char *arg, struct tunebook_time *time) {
+  char *end;
+  time->value = strtod(arg, &end);
+  time->seconds = *end == 's';
+  if (*end == 's' || *end == 'b') ++end;
+  return end == arg || *end || time->value < 0;
+}
+
+// finished songs and stems are handed to a writer thread, which
+// converts them to the output format and writes them in large
+// sequential chunks; at most WRITER_BUFFERS buffers exist at once, so
+// synthesis only waits on the disk when it gets two files ahead
+#define WRITER_BUFFERS 4
+#define WRITE_CHUNK (1 << 20)
+#define DIRECT_ALIGN 4096
+#define WAV_HEADER 44
+
+enum tunebook_format {
+  FORMAT_L16,
+  FORMAT_WAV16,
+  FORMAT_WAV24,
+  FORMAT_WAV32F,
+  FORMAT_FLAC16,
+  FORMAT_FLAC24,
+};
+
+// the samples of an output are interleaved, a frame of one for each
+// channel at a time
+struct tunebook_output {
+  char *filename;
+  float *samples;
+  long n_samples, s_samples;
+  int channels;
+  struct tunebook_output *next;
+};
+
+struct tunebook_writer {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t queued, freed;
+  struct tunebook_output *head, *tail, *free_list;
+  int n_buffers, closing, failed;
+};
+
+static enum tunebook_format output_format = FORMAT_L16;
+static int output_direct = 0;
+
+int format_bytes(enum tunebook_format format) {
+  switch (format) {
+  case FORMAT_WAV24:
+  case FORMAT_FLAC24: return 3;
+  case FORMAT_WAV32F: return 4;
+  default: return 2;
+  }
+}
+
+const char *format_extension(enum tunebook_format format) {
+  switch (format) {
+  case FORMAT_L16: return "l16";
+  case FORMAT_FLAC16:
+  case FORMAT_FLAC24: return "flac";
+  default: return "wav";
+  }
+}
+
+void put_le(unsigned char *bytes, uint32_t value, int n) {
+  for (int i = 0; i < n; ++i) bytes[i] = value >> (8 * i);
+}
+
+// the RIFF chunk of a WAV file counts its bytes in 32 bits, which the
+// data chunk and the rest of the header have to fit in
+#define WAV_MAX_DATA (UINT32_MAX - (WAV_HEADER - 8))
+
+void wav_header
+(unsigned char *header, enum tunebook_format format, long n_samples, int channels) {
+  int bytes = format_bytes(format);
+  uint32_t data = n_samples * bytes;
+  memcpy(header, "RIFF", 4);
+  put_le(header + 4, data + WAV_HEADER - 8, 4);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  put_le(header + 16, 16, 4);
+  put_le(header + 20, format == FORMAT_WAV32F ? 3 : 1, 2);
+  put_le(header + 22, channels, 2);
+  put_le(header + 24, SAMPLE_RATE, 4);
+  put_le(header + 28, SAMPLE_RATE * bytes * channels, 4);
+  put_le(header + 32, bytes * channels, 2);
+  put_le(header + 34, 8 * bytes, 2);
+  memcpy(header + 36, "data", 4);
+  put_le(header + 40, data, 4);
+}
+
+void convert_samples
+(unsigned char *bytes, const float *samples, long n, enum tunebook_format format) {
+  uint32_t bits;
+  for (long i = 0; i < n; ++i) {
+    float amp = samples[i];
+    if (format != FORMAT_WAV32F) {
+      if (amp > 1) amp = 1;
+      if (amp < -1) amp = -1;
+    }
+    switch (format) {
+    case FORMAT_L16:
+    case FORMAT_WAV16:
+      put_le(bytes, (SAMPLE)(SAMPLE_MAX * amp), 2);
+      bytes += 2;
+      break;
+    case FORMAT_WAV24:
+      put_le(bytes, (int32_t)(8388607 * amp), 3);
+      bytes += 3;
+      break;
+    case FORMAT_WAV32F:
+      memcpy(&bits, &amp, sizeof bits);
+      put_le(bytes, bits, 4);
+      bytes += 4;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+int write_all(int fd, const unsigned char *bytes, size_t n) {
+  while (n > 0) {
+    ssize_t written = write(fd, bytes, n);
+    if (written < 0) return -1;
+    bytes += written;
+    n -= written;
+  }
+  return 0;
+}
+
+// output files are written through a chunk buffer, so that every write
+// is large and, for direct files, whole blocks
+struct tunebook_sink {
+  int fd, direct;
+  unsigned char *chunk;
+  int n_chunk;
+  off_t size;
+};
+
+int sink_open
+(struct tunebook_sink *sink, const char *filename, unsigned char *chunk, off_t estimate) {
+  sink->fd = -1;
+  if (output_direct) sink->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+  if (sink->fd < 0) sink->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (sink->fd < 0) return -1;
+  sink->direct = output_direct && (fcntl(sink->fd, F_GETFL) & O_DIRECT);
+  if (output_direct) posix_fallocate(sink->fd, 0, estimate);
+  sink->chunk = chunk;
+  sink->n_chunk = 0;
+  sink->size = 0;
+  return 0;
+}
+
+int sink_write(struct tunebook_sink *sink, const unsigned char *bytes, long n) {
+  if (atomic_load(&cancelled)) return -1;
+  while (n > 0) {
+    int take = MIN(n, WRITE_CHUNK - sink->n_chunk);
+    memcpy(sink->chunk + sink->n_chunk, bytes, take);
+    sink->n_chunk += take;
+    sink->size += take;
+    bytes += take;
+    n -= take;
+    if (sink->n_chunk == WRITE_CHUNK) {
+      if (write_all(sink->fd, sink->chunk, WRITE_CHUNK)) return -1;
+      sink->n_chunk = 0;
+    }
+  }
+  return 0;
+}
+
+// flush what is left, then overwrite the header at the start of the
+// file now that the whole file is known
+int sink_close(struct tunebook_sink *sink, const unsigned char *header, int n_header) {
+  if (sink->direct && sink->n_chunk % DIRECT_ALIGN) {
+    int padded = sink->n_chunk + DIRECT_ALIGN - (sink->n_chunk % DIRECT_ALIGN);
+    memset(sink->chunk + sink->n_chunk, 0, padded - sink->n_chunk);
+    if (write_all(sink->fd, sink->chunk, padded)) goto error;
+  } else if (sink->n_chunk) {
+    if (write_all(sink->fd, sink->chunk, sink->n_chunk)) goto error;
+  }
+  if (output_direct && ftruncate(sink->fd, sink->size)) goto error;
+  if (n_header) {
+    if (sink->direct) fcntl(sink->fd, F_SETFL, fcntl(sink->fd, F_GETFL) & ~O_DIRECT);
+    if (pwrite(sink->fd, header, n_header, 0) != n_header) goto error;
+  }
+  return close(sink->fd);
+ error:
+  close(sink->fd);
+  return -1;
+}
+
+// FLAC streams are encoded with the fixed polynomial predictors of
+// order 0 to 4, choosing the best per block, and Rice coded residuals
+// split into as many partitions as pays off
+#define FLAC_BLOCK 4096
+#define FLAC_HEADER 42
+#define FLAC_MAX_PARTITION_ORDER 8
+#define FLAC_MAX_RICE 14
+
+struct tunebook_bits {
+  unsigned char *bytes;
+  long n;
+  uint64_t acc;
+  int n_acc;
+};
+
+void put_bits(struct tunebook_bits *bits, uint32_t value, int n) {
+  if (n == 0) return;
+  bits->acc = (bits->acc << n) | (value & (uint32_t)(((uint64_t)1 << n) - 1));
+  bits->n_acc += n;
+  while (bits->n_acc >= 8) {
+    bits->n_acc -= 8;
+    bits->bytes[bits->n++] = bits->acc >> bits->n_acc;
+  }
+}
+
+void put_rice(struct tunebook_bits *bits, int32_t residual, int k) {
+  uint32_t u = residual < 0 ? ((uint32_t)-(residual + 1) << 1) | 1 : (uint32_t)residual << 1;
+  uint32_t q = u >> k;
+  while (q >= 32) {
+    put_bits(bits, 0, 32);
+    q -= 32;
+  }
+  put_bits(bits, 1, q + 1);
+  put_bits(bits, u, k);
+}
+
+void align_bits(struct tunebook_bits *bits) {
+  if (bits->n_acc) put_bits(bits, 0, 8 - bits->n_acc);
+}
+
+uint8_t crc8(const unsigned char *bytes, long n) {
+  uint8_t crc = 0;
+  while (n--) {
+    crc ^= *bytes++;
+    for (int i = 0; i < 8; ++i) crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+uint16_t crc16(const unsigned char *bytes, long n) {
+  uint16_t crc = 0;
+  while (n--) {
+    crc ^= *bytes++ << 8;
+    for (int i = 0; i < 8; ++i) crc = crc & 0x8000 ? (crc << 1) ^ 0x8005 : crc << 1;
+  }
+  return crc;
+}
+
+void flac_residual(const int32_t *x, int n, int order, int32_t *r) {
+  for (int i = order; i < n; ++i) {
+    switch (order) {
+    case 0: r[i] = x[i]; break;
+    case 1: r[i] = x[i] - x[i-1]; break;
+    case 2: r[i] = x[i] - 2*x[i-1] + x[i-2]; break;
+    case 3: r[i] = x[i] - 3*x[i-1] + 3*x[i-2] - x[i-3]; break;
+    case 4: r[i] = x[i] - 4*x[i-1] + 6*x[i-2] - 4*x[i-3] + x[i-4]; break;
+    }
+  }
+}
+
+// the Rice parameter which codes a partition in the fewest bits,
+// estimated from the sum of its folded residuals
+int rice_parameter(uint64_t sum, int n, uint64_t *bits) {
+  int best = 0;
+  *bits = UINT64_MAX;
+  for (int k = 0; k <= FLAC_MAX_RICE; ++k) {
+    uint64_t cost = (uint64_t)n * (k + 1) + (sum >> k);
+    if (cost < *bits) {
+      *bits = cost;
+      best = k;
+    }
+  }
+  return best;
+}
+
+// the cost of coding the residual with the given partition order, from
+// the sums of folded residuals in each partition
+uint64_t flac_partitions
+(const uint64_t *sums, int n, int order, int partition_order, int *params) {
+  int partitions = 1 << partition_order, size = n >> partition_order;
+  uint64_t total = 0, bits;
+  for (int p = 0; p < partitions; ++p) {
+    params[p] = rice_parameter(sums[p], p ? size : size - order, &bits);
+    total += 4 + bits;
+  }
+  return total;
+}
+
+void flac_subframe
+(struct tunebook_bits *bits, const int32_t *x, int n, int bps, int32_t *r) {
+  int params[1 << FLAC_MAX_PARTITION_ORDER], best_params[1 << FLAC_MAX_PARTITION_ORDER];
+  int best_order = -1, best_partition_order = 0;
+  uint64_t best_bits = (uint64_t)n * bps;
+  int constant = 1;
+  for (int i = 1; i < n && constant; ++i) constant = x[i] == x[0];
+  if (constant) {
+    put_bits(bits, 0x00, 8);
+    put_bits(bits, x[0], bps);
+    return;
+  }
+  for (int order = 0; order <= 4 && order < n; ++order) {
+    uint64_t sums[1 << FLAC_MAX_PARTITION_ORDER];
+    int max_po = 0;
+    while (max_po < FLAC_MAX_PARTITION_ORDER && n % (2 << max_po) == 0
+           && (n >> (max_po + 1)) > order) ++max_po;
+    flac_residual(x, n, order, r);
+    // sum up the finest partitions once, and merge them pairwise for
+    // each coarser partition order
+    for (int p = 0; p < 1 << max_po; ++p) {
+      int size = n >> max_po;
+      sums[p] = 0;
+      for (int i = p ? p * size : order; i < (p + 1) * size; ++i)
+        sums[p] += r[i] < 0 ? ((uint64_t)-(int64_t)r[i] << 1) - 1 : (uint64_t)r[i] << 1;
+    }
+    for (int po = max_po; po >= 0; --po) {
+      uint64_t cost = order * bps + 6 + flac_partitions(sums, n, order, po, params);
+      if (cost < best_bits) {
+        best_bits = cost;
+        best_order = order;
+        best_partition_order = po;
+        memcpy(best_params, params, (1 << po) * sizeof *params);
+      }
+      for (int p = 0; p < 1 << (po - 1) && po > 0; ++p) sums[p] = sums[2*p] + sums[2*p + 1];
+    }
+  }
+  if (best_order < 0) {
+    put_bits(bits, 0x02, 8);
+    for (int i = 0; i < n; ++i) put_bits(bits, x[i], bps);
+    return;
+  }
+  flac_residual(x, n, best_order, r);
+  put_bits(bits, (0x08 | best_order) << 1, 8);
+  for (int i = 0; i < best_order; ++i) put_bits(bits, x[i], bps);
+  put_bits(bits, 0, 2);
+  put_bits(bits, best_partition_order, 4);
+  int size = n >> best_partition_order;
+  for (int p = 0; p < 1 << best_partition_order; ++p) {
+    put_bits(bits, best_params[p], 4);
+    for (int i = p ? p * size : best_order; i < (p + 1) * size; ++i)
+      put_rice(bits, r[i], best_params[p]);
+  }
+}
+
+// encode one frame of n samples per channel, given channel by channel
+long flac_frame
+(unsigned char *out, int32_t **x, int channels, int n, uint32_t number, int bps, int32_t *r) {
+  struct tunebook_bits bits = { out, 0, 0, 0 };
+  put_bits(&bits, 0xfff8, 16);
+  put_bits(&bits, n == FLAC_BLOCK ? 12 : 7, 4);
+  put_bits(&bits, 10, 4);
+  put_bits(&bits, channels - 1, 4);
+  put_bits(&bits, bps == 24 ? 6 : 4, 3);
+  put_bits(&bits, 0, 1);
+  // frame numbers are coded like UTF-8
+  if (number < 0x80) {
+    put_bits(&bits, number, 8);
+  } else {
+    int extra = number < 0x800 ? 1 : number < 0x10000 ? 2 : number < 0x200000 ? 3
+      : number < 0x4000000 ? 4 : 5;
+    put_bits(&bits, (0xff00 >> (extra + 1)) | (number >> (6 * extra)), 8);
+    for (int i = extra - 1; i >= 0; --i) put_bits(&bits, 0x80 | ((number >> (6 * i)) & 0x3f), 8);
+  }
+  if (n != FLAC_BLOCK) put_bits(&bits, n - 1, 16);
+  put_bits(&bits, crc8(bits.bytes, bits.n), 8);
+  for (int c = 0; c < channels; ++c) flac_subframe(&bits, x[c], n, bps, r);
+  align_bits(&bits);
+  put_bits(&bits, crc16(bits.bytes, bits.n), 16);
+  return bits.n;
+}
+
+void flac_header
+(unsigned char *out, int channels, int bps, long n_samples, long min_frame, long max_frame) {
+  struct tunebook_bits bits = { out, 0, 0, 0 };
+  int block = n_samples < FLAC_BLOCK ? MAX(16, n_samples) : FLAC_BLOCK;
+  memcpy(out, "fLaC", 4);
+  bits.n = 4;
+  put_bits(&bits, 0x80, 8);
+  put_bits(&bits, 34, 24);
+  put_bits(&bits, block, 16);
+  put_bits(&bits, block, 16);
+  put_bits(&bits, min_frame, 24);
+  put_bits(&bits, max_frame, 24);
+  put_bits(&bits, SAMPLE_RATE, 20);
+  put_bits(&bits, channels - 1, 3);
+  put_bits(&bits, bps - 1, 5);
+  put_bits(&bits, (uint64_t)n_samples >> 32, 4);
+  put_bits(&bits, n_samples, 32);
+  // the MD5 signature of the audio is left unset
+  for (int i = 0; i < 4; ++i) put_bits(&bits, 0, 32);
+}
+
+int32_t quantize(float amp, int bps) {
+  if (amp > 1) amp = 1;
+  if (amp < -1) amp = -1;
+  return bps == 24 ? (int32_t)(8388607 * amp) : (SAMPLE)(SAMPLE_MAX * amp);
+}
+
+int write_flac(struct tunebook_output *output, unsigned char *chunk) {
+  struct tunebook_sink sink;
+  unsigned char header[FLAC_HEADER], *frame;
+  int32_t *x[MAX_CHANNELS], *r;
+  long min_frame = LONG_MAX, max_frame = 0;
+  int bps = output_format == FORMAT_FLAC24 ? 24 : 16, channels = output->channels;
+  long n_frames = output->n_samples / channels;
+  if (sink_open(&sink, output->filename, chunk,
+                FLAC_HEADER + (off_t)output->n_samples * bps / 8)) return -1;
+  NEW(frame, 32 + FLAC_BLOCK * channels * (bps / 8 + 1));
+  for (int c = 0; c < channels; ++c) NEW(x[c], FLAC_BLOCK);
+  NEW(r, FLAC_BLOCK);
+  flac_header(header, channels, bps, 0, 0, 0);
+  int failed = sink_write(&sink, header, FLAC_HEADER);
+  for (long i = 0, number = 0; i < n_frames && !failed; i += FLAC_BLOCK, ++number) {
+    int n = MIN(FLAC_BLOCK, n_frames - i);
+    const float *samples = output->samples + i * channels;
+    for (int k = 0; k < n; ++k)
+      for (int c = 0; c < channels; ++c) x[c][k] = quantize(samples[k * channels + c], bps);
+    long size = flac_frame(frame, x, channels, n, number, bps, r);
+    min_frame = MIN(min_frame, size);
+    max_frame = MAX(max_frame, size);
+    failed = sink_write(&sink, frame, size);
+  }
+  free(frame);
+  for (int c = 0; c < channels; ++c) free(x[c]);
+  free(r);
+  if (min_frame > max_frame) min_frame = 0;
+  flac_header(header, channels, bps, n_frames, min_frame, max_frame);
+  if (failed) {
+    close(sink.fd);
+    return -1;
+  }
+  return sink_close(&sink, header, FLAC_HEADER);
+}
+
+int write_output(struct tunebook_output *output, unsigned char *chunk) {
+  struct tunebook_sink sink;
+  unsigned char converted[4096], header[WAV_HEADER];
+  int n_header = output_format == FORMAT_L16 ? 0 : WAV_HEADER;
+  int bytes = format_bytes(output_format);
+  if (output_format == FORMAT_FLAC16 || output_format == FORMAT_FLAC24)
+    return write_flac(output, chunk);
+  if (n_header && (int64_t)output->n_samples * bytes > WAV_MAX_DATA) {
+    fprintf(stderr, "%s is too long for a WAV file, which holds at most 4 GiB\n",
+            output->filename);
+    return -1;
+  }
+  if (sink_open(&sink, output->filename, chunk,
+                n_header + (off_t)output->n_samples * bytes)) return -1;
+  // the header is written as a placeholder and patched on close
+  wav_header(header, output_format, 0, output->channels);
+  int failed = sink_write(&sink, header, n_header);
+  for (long i = 0; i < output->n_samples && !failed;) {
+    long n = MIN(output->n_samples - i, (long)sizeof converted / bytes);
+    convert_samples(converted, output->samples + i, n, output_format);
+    failed = sink_write(&sink, converted, n * bytes);
+    i += n;
+  }
+  if (failed) {
+    close(sink.fd);
+    return -1;
+  }
+  wav_header(header, output_format, output->n_samples, output->channels);
+  return sink_close(&sink, header, n_header);
+}
+
+void *writer_thread(void *arg) {
+  struct tunebook_writer *writer = arg;
+  struct tunebook_output *output;
+  unsigned char *chunk;
+  if (posix_memalign((void **)&chunk, DIRECT_ALIGN, WRITE_CHUNK + DIRECT_ALIGN)) chunk = NULL;
+  pthread_mutex_lock(&writer->lock);
+  for (;;) {
+    while (!writer->head && !writer->closing)
+      pthread_cond_wait(&writer->queued, &writer->lock);
+    if (!writer->head) break;
+    output = writer->head;
+    pthread_mutex_unlock(&writer->lock);
+    int failed = !chunk || write_output(output, chunk);
+    // a file which could not be finished is not left behind
+    if (failed) unlink(output->filename);
+    if (failed && !atomic_load(&cancelled))
+      fprintf(stderr, "could not write %s\n", output->filename);
+    pthread_mutex_lock(&writer->lock);
+    writer->failed |= failed;
+    writer->head = output->next;
+    if (!writer->head) writer->tail = NULL;
+    free(output->filename);
+    output->next = writer->free_list;
+    writer->free_list = output;
+    pthread_cond_signal(&writer->freed);
+  }
+  pthread_mutex_unlock(&writer->lock);
+  free(chunk);
+  return NULL;
+}
+
+void writer_start(struct tunebook_writer *writer) {
+  writer->head = writer->tail = writer->free_list = NULL;
+  writer->n_buffers = writer->closing = writer->failed = 0;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->queued, NULL);
+  pthread_cond_init(&writer->freed, NULL);
+  start_thread(&writer->thread, writer_thread, writer);
+}
+
+// an empty output buffer, waiting for the writer to finish with one if
+// all of them are in use
+struct tunebook_output *writer_buffer(struct tunebook_writer *writer) {
+  struct tunebook_output *output;
+  pthread_mutex_lock(&writer->lock);
+  while (!writer->free_list && writer->n_buffers >= WRITER_BUFFERS)
+    pthread_cond_wait(&writer->freed, &writer->lock);
+  if (writer->free_list) {
+    output = writer->free_list;
+    writer->free_list = output->next;
+  } else {
+    NEW(output, 1);
+    output->s_samples = SAMPLE_RATE;
+    NEW(output->samples, output->s_samples);
+    writer->n_buffers++;
+  }
+  pthread_mutex_unlock(&writer->lock);
+  output->n_samples = 0;
+  output->channels = 1;
+  output->next = NULL;
+  return output;
+}
+
+// make the output at least n samples long, with silence after what is
+// already there
+void output_reserve(struct tunebook_output *output, long n) {
+  if (n > output->s_samples) {
+    output->s_samples = MAX(n, 2 * output->s_samples);
+    RESIZE(output->samples, output->s_samples);
+  }
+  if (n > output->n_samples) {
+    memset(output->samples + output->n_samples, 0,
+           (n - output->n_samples) * sizeof *output->samples);
+    output->n_samples = n;
+  }
+}
+
+// the gain of each of a song's channels for a voice at the given pan,
+// which is shared at equal power between the two channels either side
+void pan_gains(int channels, double pan, float *gains) {
+  double at = (pan + 1) / 2 * (channels - 1);
+  int left = MIN(channels - 2, (int)at);
+  for (int c = 0; c < channels; ++c) gains[c] = 0;
+  if (channels == 1) {
+    gains[0] = 1;
+    return;
+  }
+  gains[left] = cos((at - left) * M_PI / 2);
+  gains[left + 1] = sin((at - left) * M_PI / 2);
+}
+
+// add n samples, each scaled by the gain of every channel, to the frames
+// of an interleaved output; mono and stereo have loops of their own,
+// which the compiler can vectorize
+void mix_channels(float *out, const float *in, long n, int channels, const float *gains) {
+  float left = gains[0], right = gains[channels > 1];
+  switch (channels) {
+  case 1:
+    for (long i = 0; i < n; ++i) out[i] += left * in[i];
+    break;
+  case 2:
+    for (long i = 0; i < n; ++i) {
+      out[2*i] += left * in[i];
+      out[2*i + 1] += right * in[i];
+    }
+    break;
+  default:
+    for (long i = 0; i < n; ++i)
+      for (int c = 0; c < channels; ++c) out[i * channels + c] += gains[c] * in[i];
+  }
+}
+
+void writer_submit
+(struct tunebook_writer *writer, struct tunebook_output *output, char *filename) {
+  output->filename = filename;
+  pthread_mutex_lock(&writer->lock);
+  if (writer->tail) writer->tail->next = output;
+  else writer->head = output;
+  writer->tail = output;
+  pthread_cond_signal(&writer->queued);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+// hand back a buffer which is not to be written after all
+void writer_discard(struct tunebook_writer *writer, struct tunebook_output *output) {
+  pthread_mutex_lock(&writer->lock);
+  output->next = writer->free_list;
+  writer->free_list = output;
+  pthread_cond_signal(&writer->freed);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+int writer_finish(struct tunebook_writer *writer) {
+  pthread_mutex_lock(&writer->lock);
+  writer->closing = 1;
+  pthread_cond_signal(&writer->queued);
+  pthread_mutex_unlock(&writer->lock);
+  pthread_join(writer->thread, NULL);
+  while (writer->free_list) {
+    struct tunebook_output *output = writer->free_list;
+    writer->free_list = output->next;
+    free(output->samples);
+    free(output);
+  }
+  pthread_mutex_destroy(&writer->lock);
+  pthread_cond_destroy(&writer->queued);
+  pthread_cond_destroy(&writer->freed);
+  return writer->failed ? -1 : 0;
+}
+
+// reverb convolves a song's send bus with an impulse response, read
+// from a raw file in the same format as .l16 output; the convolution is
+// uniformly partitioned: the response is cut into blocks which are each
+// transformed once, and every block of the bus is transformed once and
+// multiplied against all of them in the frequency domain
+#define REVERB_BLOCK 1024
+
+struct tunebook_reverb {
+  long n_response;
+  int n_partitions;
+  double complex *partitions, *twiddles;
+};
+
+// in-place radix-2 transform of n points, using n/2 twiddle factors
+void fft(double complex *x, int n, int inverse, const double complex *twiddles) {
+  for (int i = 1, j = 0; i < n; ++i) {
+    int bit = n >> 1;
+    for (; j & bit; bit >>= 1) j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      double complex t = x[i];
+      x[i] = x[j];
+      x[j] = t;
+    }
+  }
+  for (int len = 2; len <= n; len <<= 1) {
+    int stride = n / len;
+    for (int i = 0; i < n; i += len) {
+      for (int k = 0; k < len / 2; ++k) {
+        double complex w = twiddles[k * stride];
+        if (inverse) w = conj(w);
+        double complex u = x[i + k], v = x[i + k + len / 2] * w;
+        x[i + k] = u + v;
+        x[i + k + len / 2] = u - v;
+      }
+    }
+  }
+}
+
+long reverb_length(const char *path) {
+  struct stat st;
+  if (stat(path, &st)) return -1;
+  return st.st_size / sizeof(SAMPLE);
+}
+
+// what convolving with a response of n samples takes: its transformed
+// partitions, and a ring of as many transformed blocks of the bus
+int64_t reverb_bytes(long n_response) {
+  long n_partitions = MAX(1, (n_response + REVERB_BLOCK - 1) / REVERB_BLOCK);
+  return 2 * n_partitions * 2 * REVERB_BLOCK * (int64_t)sizeof(double complex);
+}
+
+int reverb_load(struct tunebook_reverb *reverb, const char *path) {
+  int n = 2 * REVERB_BLOCK;
+  unsigned char bytes[2];
+  FILE *in = fopen(path, "rb");
+  if (!in) return -1;
+  reverb->n_response = reverb_length(path);
+  reverb->n_partitions = MAX(1, (reverb->n_response + REVERB_BLOCK - 1) / REVERB_BLOCK);
+  reverb->partitions = calloc(reverb->n_partitions * n, sizeof *reverb->partitions);
+  NEW(reverb->twiddles, n / 2);
+  for (int k = 0; k < n / 2; ++k) reverb->twiddles[k] = cexp(-2 * M_PI * I * k / n);
+  for (long t = 0; t < reverb->n_response && fread(bytes, 2, 1, in) == 1; ++t) {
+    int16_t sample = bytes[0] | bytes[1] << 8;
+    reverb->partitions[t / REVERB_BLOCK * n + t % REVERB_BLOCK] = (double)sample / SAMPLE_MAX;
+  }
+  fclose(in);
+  for (int p = 0; p < reverb->n_partitions && !atomic_load(&cancelled); ++p)
+    fft(reverb->partitions + p * n, n, 0, reverb->twiddles);
+  return 0;
+}
+
+void reverb_free(struct tunebook_reverb *reverb) {
+  free(reverb->partitions);
+  free(reverb->twiddles);
+}
+
+// add the convolution of n_bus samples with the response to out, which
+// must hold n_bus + n_response - 1 samples; a block of output needs the
+// transforms of the last n_partitions blocks of input, kept in a ring
+void reverb_apply
+(struct tunebook_reverb *reverb, const float *bus, long n_bus, float *out) {
+  int n = 2 * REVERB_BLOCK, n_partitions = reverb->n_partitions;
+  long n_out = n_bus + reverb->n_response - 1;
+  double complex *ring = calloc(n_partitions * n, sizeof *ring), *sum;
+  NEW(sum, n);
+  for (long k = 0; k * REVERB_BLOCK < n_out && !atomic_load(&cancelled); ++k) {
+    double complex *x = ring + k % n_partitions * n;
+    for (int i = 0; i < n; ++i) {
+      long t = (k - 1) * REVERB_BLOCK + i;
+      x[i] = t >= 0 && t < n_bus ? bus[t] : 0;
+    }
+    fft(x, n, 0, reverb->twiddles);
+    // the input is real, so only half the spectrum has to be summed
+    memset(sum, 0, (n / 2 + 1) * sizeof *sum);
+    for (int p = 0; p < n_partitions && p <= k; ++p) {
+      double complex *past = ring + (k - p) % n_partitions * n;
+      double complex *h = reverb->partitions + p * n;
+      for (int i = 0; i <= n / 2; ++i) sum[i] += past[i] * h[i];
+    }
+    for (int i = n / 2 + 1; i < n; ++i) sum[i] = conj(sum[n - i]);
+    fft(sum, n, 1, reverb->twiddles);
+    for (int i = 0; i < REVERB_BLOCK && k * REVERB_BLOCK + i < n_out; ++i)
+      out[k * REVERB_BLOCK + i] += creal(sum[REVERB_BLOCK + i]) / n;
+  }
+  free(ring);
+  free(sum);
+}
+
+static int render_stems = 0, dry_run = 0;
+
+// the songs asked for with --song, as glob patterns; none means all
+static char **song_patterns = NULL;
+static int n_song_patterns = 0;
+
+int song_selected(struct tunebook_song *song) {
+  if (!n_song_patterns) return 1;
+  for (int p = 0; p < n_song_patterns; ++p)
+    if (!fnmatch(song_patterns[p], song->name, 0)) return 1;
+  return 0;
+}
+
+int selected_songs(struct tunebook_book *book) {
+  int n = 0;
+  for (int p = 0; p < n_song_patterns; ++p) {
+    int s;
+    for (s = 0; s < book->n_songs; ++s)
+      if (!fnmatch(song_patterns[p], book->songs[s].name, 0)) break;
+    if (s == book->n_songs) fprintf(stderr, "no song matches %s\n", song_patterns[p]);
+  }
+  for (int s = 0; s < book->n_songs; ++s) n += song_selected(&book->songs[s]);
+  return n;
+}
+
+// the bytes a song is rendered in for each sample it is long: the voice
+// being rendered, the mix, the reverb's bus, and any stems waiting on
+// the writer
+int song_frame_bytes(struct tunebook_song *song) {
+  int buffers = 1 + song->channels + (song->reverb ? 1 : 0)
+    + (render_stems ? WRITER_BUFFERS * song->channels : 0);
+  return buffers * sizeof(float);
+}
+
+// look over the songs to be rendered before rendering any of them: a
+// repeat must close a section, sections nest no deeper than the limit,
+// and no voice may be certain to be too long or too big. a voice is at
+// least as long as its beats, each repeated as few times as it might
+// be and stretched as little as its grooves do
+int tunebook_check_book(struct tunebook_book *book, struct tunebook_error *error) {
+  struct tunebook_song *song;
+  double *beats;
+  NEW(beats, limits.depth + 1);
+  for (int s = 0; s < book->n_songs; ++s) {
+    song = &book->songs[s];
+    if (!song_selected(song)) continue;
+    long from = time_to_samples(render_from, song->tempo);
+    long to = time_to_samples(render_to, song->tempo);
+    // a reverb is transformed whole, so one too big is refused whatever
+    // is sent to it
+    long n_response = song->reverb ? reverb_length(song->reverb) : -1;
+    if (!dry_run && limits.memory && n_response >= 0 && reverb_bytes(n_response)
+        + n_response * (int64_t)song_frame_bytes(song) > limits.memory) {
+      fprintf(stderr, "the reverb of %s needs more than %lli bytes\n", song->name,
+              (long long)limits.memory);
+      error->type = ERROR_LIMIT;
+      goto error;
+    }
+    for (int v = 0; v < song->n_voices; ++v) {
+      struct tunebook_voice *voice = &song->voices[v];
+      double stretch = 1, count, samples;
+      int depth = 0;
+      if ((error->type = atomic_load(&cancelled))) goto error;
+      beats[0] = 0;
+      for (int c = 0; c < voice->n_commands; ++c) {
+        const uint32_t *groove;
+        struct tunebook_number number;
+        switch (voice->ops[c]) {
+        case VOICE_COMMAND_SECTION:
+          if (depth == limits.depth) {
+            fprintf(stderr, "%s:%i: sections nest deeper than %i\n",
+                    voice->source, voice->lines[c], limits.depth);
+            error->type = ERROR_TOO_DEEP;
+            goto error;
+          }
+          beats[++depth] = 0;
+          break;
+        case VOICE_COMMAND_REPEAT:
+          if (!depth) {
+            fprintf(stderr, "%s:%i: repeat without a section\n",
+                    voice->source, voice->lines[c]);
+            error->type = ERROR_UNMATCHED_REPEAT;
+            goto error;
+          }
+          // how many times an exponential repeat goes depends on the base
+          // it is played in, which may be anything
+          number = unpack_number(voice, voice->operands[c]);
+          count = number.type == NUMBER_RATIONAL ? floor(number_to_double(1, number)) : 0;
+          beats[depth-1] += beats[depth] * (1 + (count > 0 ? count : 0));
+          --depth;
+          break;
+        case VOICE_COMMAND_GROOVE:
+          groove = &voice->notes[voice->operands[c]];
+          for (uint32_t g = 0; g < groove[0]; ++g) {
+            double at = number_to_double(1, unpack_number(voice, groove[1 + g]));
+            stretch = MIN(stretch, at > 0 ? at : 0);
+          }
+          break;
+        case VOICE_COMMAND_CHORD:
+        case VOICE_COMMAND_NOTE:
+        case VOICE_COMMAND_REST:
+          ++beats[depth];
+          break;
+        }
+      }
+      for (; depth > 0; --depth) beats[depth-1] += beats[depth];
+      samples = MIN(beats[0] * beat_samples(song->tempo, stretch), to) - from;
+      if (dry_run) continue;
+      if (limits.samples && samples > limits.samples) {
+        fprintf(stderr, "voice %i of %s is at least %.0f samples long, more than %li\n",
+                v + 1, song->name, samples, limits.samples);
+        error->type = ERROR_LIMIT;
+        goto error;
+      }
+      if (limits.memory && samples * song_frame_bytes(song) > limits.memory) {
+        fprintf(stderr, "voice %i of %s needs at least %.0f bytes, more than %lli\n",
+                v + 1, song->name, samples * song_frame_bytes(song),
+                (long long)limits.memory);
+        error->type = ERROR_LIMIT;
+        goto error;
+      }
+    }
+  }
+  free(beats);
+  return 0;
+ error:
+  error->last_token.type = TOKEN_STRING;
+  error->last_token.as.string = song->name;
+  free(beats);
+  return -1;
+}
+
+// run through a voice's commands from the start of its song
+void play_voice
+(struct tunebook_render_context *cx, struct tunebook_instrument *instrument,
+ struct tunebook_voice *voice) {
+  cx->groove = NULL;
+  cx->last_freq_command = -1;
+  cx->base = 2;
+  cx->tempo = cx->song->tempo;
+  cx->root = cx->song->root;
+  cx->osc = 0;
+  cx->beat = 0;
+  cx->legato = 0;
+  cx->time = 0;
+  cx->end = 0;
+  cx->n_samples = 0;
+  cx->n_sections = 0;
+  cx->n_notes = 0;
+  cx->n_chords = 0;
+  cx->evaluations = 0;
+  cx->n_repeats = 0;
+  cx->n_played = 0;
+  for (int c = 0; c < voice->n_commands && cx->time < cx->to && !halted(cx); ++c) {
+    int progress = 100 * ((double)c/voice->n_commands);
+    if (!cx->dry && !cx->scheduling && progress % 10 == 0) {
+      putchar('.');
+      fflush(stdout);
+    }
+    process_command(cx, instrument, voice, c);
+  }
+}
+
+// walk through one voice of a song, rendering it into the context's
+// buffer unless this is a dry run
+int render_voice
+(struct tunebook_render_context *cx, struct tunebook_book *book,
+ struct tunebook_song *song, int v, struct tunebook_error *error) {
+  struct tunebook_voice *voice = &song->voices[v];
+  struct tunebook_instrument *instrument = &book->instruments[voice->instrument_i];
+  cx->song = song;
+  cx->voice = voice;
+  if (!cx->dry) printf("\t- %s", voice->instrument);
+  if (tunebook_prepare_instrument(instrument, error)) return -1;
+  // notes go to the carriers in turn, so there has to be one
+  int n_carriers = 0;
+  for (int o = 0; o < instrument->n_oscillators; ++o)
+    n_carriers += !is_modulator(instrument, o);
+  if (!n_carriers) {
+    error->type = ERROR_NO_CARRIER;
+    error->last_token.type = TOKEN_STRING;
+    error->last_token.as.string = instrument->name;
+    return -1;
+  }
+  for (int o = 0; o < instrument->n_oscillators; ++o) {
+    struct tunebook_oscillator *osc = &instrument->oscillators[o];
+    if (osc->shape != OSC_BUS) continue;
+    osc->lfo = NULL;
+    for (int l = 0; l < song->n_lfos; ++l)
+      if (!strcmp(song->lfos[l].name, osc->bus)) osc->lfo = &song->lfos[l];
+    if (!osc->lfo) {
+      error->type = ERROR_UNKNOWN_LFO;
+      error->last_token.type = TOKEN_STRING;
+      error->last_token.as.string = osc->bus;
+      return -1;
+    }
+  }
+  if (kernel_dir && !cx->dry && !instrument->kernel && !atomic_load(&cancelled)) {
+    struct tunebook_instrument *shared = instrument->origin ? instrument->origin : instrument;
+    noise(0);
+    if (!shared->kernel) shared->kernel = tunebook_load_kernel(shared);
+    instrument->kernel = shared->kernel;
+    if (!instrument->kernel)
+      fprintf(stderr, "no kernel for %s, interpreting it\n", instrument->name);
+  }
+  RESIZE(cx->buffers, cx->n_batch * instrument->n_oscillators * CHORD_LANES * control_period);
+  if (instrument->oversample > 1) RESIZE(cx->window, CHORD_LANES * oversample_window(instrument));
+  RESIZE(cx->filters, 2 * CHORD_LANES * instrument->n_oscillators);
+  if (cx->profile) {
+    RESIZE(cx->osc_seconds, instrument->n_oscillators);
+    memset(cx->osc_seconds, 0, instrument->n_oscillators * sizeof *cx->osc_seconds);
+  }
+  // a split voice is only ever scheduled, and its notes rendered from
+  // the schedule; the profiler follows each note back to its command, so
+  // a voice being profiled is played through in order as ever
+  int split = split_notes && !cx->dry && !cx->profile;
+  if (voice->polyphony || split) {
+    cx->scheduling = 1;
+    cx->n_scheduled = 0;
+    play_voice(cx, instrument, voice);
+    cx->scheduling = 0;
+    if (voice->polyphony && !cx->halted) steal_notes(cx, instrument, voice->polyphony);
+  }
+  if (split && !cx->halted) render_split(cx, instrument);
+  else if (!cx->halted) play_voice(cx, instrument, voice);
+  if (!cx->dry) putchar('\n');
+  if (cx->halted) {
+    error->type = cx->halted;
+    error->last_token.type = TOKEN_STRING;
+    error->last_token.as.string = song->name;
+    return -1;
+  }
+  cx->spent += cx->evaluations;
+  return 0;
+}
+
+int compare_profile_entries(const void *a, const void *b) {
+  const struct tunebook_profile_entry *x = a, *y = b;
+  if (x->seconds != y->seconds) return x->seconds < y->seconds ? 1 : -1;
+  if (x->evaluations != y->evaluations) return x->evaluations < y->evaluations ? 1 : -1;
+  return strcmp(x->key, y->key);
+}
+
+// the table's entries, hottest first
+struct tunebook_profile_entry *profile_sorted(struct tunebook_profile_table *table) {
+  struct tunebook_profile_entry *sorted;
+  int n = 0;
+  NEW(sorted, table->n_entries + 1);
+  for (int e = 0; e < table->s_entries; ++e)
+    if (table->entries[e].key) sorted[n++] = table->entries[e];
+  qsort(sorted, n, sizeof *sorted, compare_profile_entries);
+  return sorted;
+}
+
+void print_profile_table
+(struct tunebook_profile *profile, struct tunebook_profile_table *table,
+ const char *title, const char *plays) {
+  struct tunebook_profile_entry *sorted = profile_sorted(table);
+  printf("%-36s %9s %7s %13s %7s\n", title, "seconds", "share", "evaluations", plays);
+  for (int e = 0; e < MIN(PROFILE_TOP, table->n_entries); ++e)
+    printf("  %-34s %9.3f %6.1f%% %13lli %7li\n", sorted[e].key, sorted[e].seconds,
+           profile->seconds > 0 ? 100 * sorted[e].seconds / profile->seconds : 0,
+           (long long)sorted[e].evaluations, sorted[e].plays);
+  free(sorted);
+}
+
+// where the time went, by source line, instrument and oscillator;
+// repeats are charged with everything played inside of them
+void tunebook_print_profile(struct tunebook_profile *profile) {
+  printf("profile: %.3f seconds synthesizing, %lli oscillator evaluations\n",
+         profile->seconds, (long long)profile->evaluations);
+  print_profile_table(profile, &profile->lines, "hot lines", "notes");
+  print_profile_table(profile, &profile->instruments, "instruments", "notes");
+  print_profile_table(profile, &profile->oscillators, "oscillators", "notes");
+}
+
+// write every stack with the microseconds spent in it, in the folded
+// format flame graph tools read
+int tunebook_write_folded(struct tunebook_profile *profile, const char *path) {
+  FILE *out = fopen(path, "w");
+  if (!out) return -1;
+  struct tunebook_profile_entry *sorted = profile_sorted(&profile->stacks);
+  for (int e = 0; e < profile->stacks.n_entries; ++e) {
+    long long micros = llround(sorted[e].seconds * 1e6);
+    if (micros > 0) fprintf(out, "%s %lli\n", sorted[e].key, micros);
+  }
+  free(sorted);
+  return fclose(out);
+}
+
+// the size of an output file of n samples; FLAC can only be guessed at
+int64_t output_bytes(long n_samples) {
+  int64_t bytes = (int64_t)n_samples * format_bytes(output_format);
+  switch (output_format) {
+  case FORMAT_L16: return bytes;
+  case FORMAT_FLAC16:
+  case FORMAT_FLAC24: return FLAC_HEADER + bytes / 2;
+  default: return WAV_HEADER + bytes;
+  }
+}
+
+void print_json_string(const char *string) {
+  putchar('"');
+  for (; *string; ++string) {
+    if (*string == '"' || *string == '\\') printf("\\%c", *string);
+    else if ((unsigned char)*string < 0x20) printf("\\u%04x", *string);
+    else putchar(*string);
+  }
+  putchar('"');
+}
+
+// report what rendering the book would cost, as JSON, without rendering
+int tunebook_dry_run
+(struct tunebook_book *book, struct tunebook_error *error) {
+  struct tunebook_render_context cx;
+  int64_t book_bytes = 0, book_evaluations = 0;
+  long book_samples = 0;
+  cx.s_sections = 8;
+  NEW(cx.sections, cx.s_sections);
+  cx.buffers = NULL;
+  cx.n_batch = 1;
+  cx.filters = NULL;
+  cx.window = NULL;
+  cx.scheduling = 0;
+  cx.notes = NULL;
+  cx.s_scheduled = 0;
+  cx.pool = NULL;
+  cx.dry = 1;
+  cx.halted = 0;
+  cx.spent = 0;
+  cx.profile = NULL;
+  cx.s_repeats = 8;
+  NEW(cx.repeats, cx.s_repeats);
+  printf("{\"songs\": [");
+  selected_songs(book);
+  for (int s = 0, n_printed = 0; s < book->n_songs; ++s) {
+    struct tunebook_song *song = &book->songs[s];
+    int64_t song_bytes = 0, song_evaluations = 0;
+    long song_samples = 0, song_notes = 0, song_chords = 0, bus_samples = 0;
+    if (!song_selected(song)) continue;
+    cx.from = time_to_samples(render_from, song->tempo);
+    cx.to = time_to_samples(render_to, song->tempo);
+    cx.frame_bytes = song_frame_bytes(song);
+    printf("%s\n  {\"name\": ", n_printed++ ? "," : "");
+    print_json_string(song->name);
+    printf(", \"voices\": [");
+    for (int v = 0; v < song->n_voices; ++v) {
+      if (render_voice(&cx, book, song, v, error)) goto error;
+      long samples = MAX(0, MIN(cx.end, cx.to) - cx.from);
+      int64_t bytes = render_stems ? output_bytes(samples * song->channels) : 0;
+      printf("%s\n    {\"instrument\": ", v ? "," : "");
+      print_json_string(song->voices[v].instrument);
+      printf(", \"samples\": %li, \"notes\": %li, \"chords\": %li, "
+             "\"oscillator_evaluations\": %lli, \"bytes\": %lli}",
+             samples, cx.n_notes, cx.n_chords,
+             (long long)cx.evaluations, (long long)bytes);
+      song_samples = MAX(song_samples, samples);
+      if (song->reverb && song->voices[v].send) bus_samples = MAX(bus_samples, samples);
+      song_notes += cx.n_notes;
+      song_chords += cx.n_chords;
+      song_evaluations += cx.evaluations;
+      song_bytes += bytes;
+    }
+    if (bus_samples) {
+      long n_response = reverb_length(song->reverb);
+      if (n_response < 0) {
+        error->type = ERROR_FILE_NOT_FOUND;
+        error->last_token.type = TOKEN_STRING;
+        error->last_token.as.string = song->reverb;
+        goto error;
+      }
+      bus_samples += MAX(1, n_response) - 1;
+      song_samples = MAX(song_samples, bus_samples);
+      if (render_stems) song_bytes += output_bytes(bus_samples * song->channels);
+    }
+    song_bytes += output_bytes(song_samples * song->channels);
+    printf("],\n   \"samples\": %li, \"seconds\": %.3f, \"notes\": %li, \"chords\": %li, "
+           "\"oscillator_evaluations\": %lli, \"bytes\": %lli}",
+           song_samples, (double)song_samples / SAMPLE_RATE, song_notes, song_chords,
+           (long long)song_evaluations, (long long)song_bytes);
+    book_samples += song_samples;
+    book_evaluations += song_evaluations;
+    book_bytes += song_bytes;
+  }
+  printf("],\n \"samples\": %li, \"oscillator_evaluations\": %lli, \"bytes\": %lli}\n",
+         book_samples, (long long)book_evaluations, (long long)book_bytes);
+  free(cx.sections);
+  free(cx.repeats);
+  free(cx.buffers);
+  free(cx.filters);
+  free(cx.window);
+  free(cx.notes);
+  return 0;
+ error:
+  free(cx.sections);
+  free(cx.repeats);
+  free(cx.buffers);
+  free(cx.filters);
+  free(cx.window);
+  free(cx.notes);
+  return -1;
+}
+
+// where songs are written, when not to the current directory
+static char *output_dir = NULL;
+
+// the file a song is written to, or with a voice number, the file that
+// voice's stem is written to
+char *song_filename(struct tunebook_song *song, int voice) {
+  const char *dir = output_dir ? output_dir : ".";
+  int n_filename = strlen(dir) + strlen(song->name) + 32;
+  const char *extension = format_extension(output_format);
+  char *filename = malloc(n_filename);
+  if (voice < 0) snprintf(filename, n_filename, "%s/%s.reverb.%s", dir, song->name, extension);
+  else if (voice) snprintf(filename, n_filename, "%s/%s.voice-%i.%s", dir, song->name, voice, extension);
+  else snprintf(filename, n_filename, "%s/%s.%s", dir, song->name, extension);
+  return filename;
+}
+
+int tunebook_write_book
+(struct tunebook_book *book, struct tunebook_pool *pool, struct tunebook_error *error) {
+  struct tunebook_song *song;
+  struct tunebook_render_context cx;
+  struct tunebook_writer writer;
+  struct tunebook_output *mix, *stem, bus = { 0 };
+  struct tunebook_profile book_profile = { 0 };
+  cx.s_sections = 8;
+  cx.n_sections = 0;
+  NEW(cx.sections, cx.s_sections);
+  cx.s_repeats = 8;
+  NEW(cx.repeats, cx.s_repeats);
+  cx.buffers = NULL;
+  cx.filters = NULL;
+  cx.window = NULL;
+  cx.scheduling = 0;
+  cx.notes = NULL;
+  cx.s_scheduled = 0;
+  cx.osc_seconds = NULL;
+  cx.profile = profile ? &book_profile : NULL;
+  // with a pool, a batch holds enough blocks to be worth handing to it
+  cx.n_batch = pool ? (PARALLEL_MIN_WORK + control_period - 1) / control_period : 1;
+  NEW(cx.inputs, (12 + cx.n_batch) * CHORD_LANES * control_period);
+  cx.freq = cx.inputs + 12 * CHORD_LANES * control_period;
+  NEW(cx.points, cx.n_batch + 1);
+  cx.pool = pool;
+  cx.s_samples = SAMPLE_RATE;
+  NEW(cx.samples, cx.s_samples);
+  cx.dry = 0;
+  cx.halted = 0;
+  cx.spent = 0;
+  writer_start(&writer);
+  int n_songs = selected_songs(book);
+  printf("book has %i %s to render\n", n_songs, n_songs == 1 ? "song" : "songs");
+  for (int s = 0 ; s < book->n_songs; ++s) {
+    song = &book->songs[s];
+    if (!song_selected(song)) continue;
+    printf("song %i: %s\n\tvoices: %i\n", s+1, song->name, song->n_voices);
+    cx.from = time_to_samples(render_from, song->tempo);
+    cx.to = time_to_samples(render_to, song->tempo);
+    cx.frame_bytes = song_frame_bytes(song);
+    int channels = song->channels;
+    float gains[MAX_CHANNELS];
+    mix = writer_buffer(&writer);
+    mix->channels = channels;
+    for (int v = 0; v < song->n_voices; ++v) {
+      if (render_voice(&cx, book, song, v, error)) goto error;
+      // every voice is rendered once, on its own, and then mixed into
+      // the song's channels, so the stems add up to the song before
+      // either is rounded to the output format
+      reserve_samples(&cx, cx.end);
+      pan_gains(channels, song->voices[v].pan, gains);
+      output_reserve(mix, cx.n_samples * channels);
+      mix_channels(mix->samples, cx.samples, cx.n_samples, channels, gains);
+      if (song->reverb && song->voices[v].send) {
+        double send = song->voices[v].send;
+        output_reserve(&bus, cx.n_samples);
+        for (long i = 0; i < cx.n_samples; ++i) bus.samples[i] += send * cx.samples[i];
+      }
+      if (render_stems && channels > 1) {
+        stem = writer_buffer(&writer);
+        stem->channels = channels;
+        output_reserve(stem, cx.n_samples * channels);
+        mix_channels(stem->samples, cx.samples, cx.n_samples, channels, gains);
+        writer_submit(&writer, stem, song_filename(song, v+1));
+      } else if (render_stems) {
+        // hand the voice's buffer over to the writer and carry on
+        // rendering into a fresh one
+        stem = writer_buffer(&writer);
+        float *samples = stem->samples;
+        long s_samples = stem->s_samples;
+        stem->samples = cx.samples;
+        stem->n_samples = cx.n_samples;
+        stem->s_samples = cx.s_samples;
+        cx.samples = samples;
+        cx.s_samples = s_samples;
+        writer_submit(&writer, stem, song_filename(song, v+1));
+      }
+    }
+    if (bus.n_samples) {
+      struct tunebook_reverb reverb;
+      long n_response = reverb_length(song->reverb);
+      if (limits.memory && reverb_bytes(n_response)
+          + (bus.n_samples + n_response) * (int64_t)cx.frame_bytes > limits.memory) {
+        fprintf(stderr, "the reverb of %s needs more than %lli bytes\n", song->name,
+                (long long)limits.memory);
+        error->type = ERROR_LIMIT;
+        goto error;
+      }
+      if (reverb_load(&reverb, song->reverb)) {
+        error->type = ERROR_FILE_NOT_FOUND;
+        error->last_token.type = TOKEN_STRING;
+        error->last_token.as.string = song->reverb;
+        goto error;
+      }
+      long n_out = bus.n_samples + reverb.n_response - 1;
+      // the reverb is a stem of its own, so stems still add up to the mix;
+      // it is mono, and comes out of every channel alike at equal power
+      struct tunebook_output *wet = render_stems ? writer_buffer(&writer) : mix;
+      wet->channels = channels;
+      if (channels > 1) {
+        struct tunebook_output mono = { 0 };
+        output_reserve(&mono, n_out);
+        reverb_apply(&reverb, bus.samples, bus.n_samples, mono.samples);
+        for (int c = 0; c < channels; ++c) gains[c] = 1 / sqrt(channels);
+        output_reserve(wet, n_out * channels);
+        mix_channels(wet->samples, mono.samples, n_out, channels, gains);
+        free(mono.samples);
+      } else {
+        output_reserve(wet, n_out);
+        reverb_apply(&reverb, bus.samples, bus.n_samples, wet->samples);
+      }
+      reverb_free(&reverb);
+      if (render_stems) {
+        output_reserve(mix, n_out * channels);
+        for (long i = 0; i < n_out * channels; ++i) mix->samples[i] += wet->samples[i];
+        writer_submit(&writer, wet, song_filename(song, -1));
+      }
+      bus.n_samples = 0;
+    }
+    writer_submit(&writer, mix, song_filename(song, 0));
+  }
+  free(bus.samples);
+  free(cx.sections);
+  free(cx.repeats);
+  free(cx.buffers);
+  free(cx.filters);
+  free(cx.window);
+  free(cx.notes);
+  free(cx.osc_seconds);
+  free(cx.inputs);
+  free(cx.points);
+  free(cx.samples);
+  if (writer_finish(&writer)) {
+    error->type = cancelled_or(ERROR_FILE_NOT_FOUND);
+    return -1;
+  }
+  if (profile) {
+    tunebook_print_profile(&book_profile);
+    if (profile_folded && tunebook_write_folded(&book_profile, profile_folded)) {
+      error->type = ERROR_FILE_NOT_FOUND;
+      return -1;
+    }
+  }
+  return 0;
+ error:
+  // nothing of a song which failed is left behind, not even the stems
+  // of the voices rendered before it did
+  writer_discard(&writer, mix);
+  writer_finish(&writer);
+  for (int v = -1; v <= song->n_voices; ++v) {
+    char *filename = song_filename(song, v);
+    unlink(filename);
+    free(filename);
+  }
+  free(bus.samples);
+  free(cx.sections);
+  free(cx.repeats);
+  free(cx.buffers);
+  free(cx.filters);
+  free(cx.window);
+  free(cx.notes);
+  free(cx.osc_seconds);
+  free(cx.inputs);
+  free(cx.points);
+  free(cx.samples);
+  return -1;
+}
+
+// free the scores of a book's own songs, which are nearly all of what a
+// parsed book holds; instruments are small, and may be shared with the
+// include cache, so they are left be
+void tunebook_free_book(struct tunebook_book *book) {
+  for (int s = 0; s < book->n_songs; ++s) {
+    struct tunebook_song *song = &book->songs[s];
+    if (song->cached) continue;
+    for (int v = 0; v < song->n_voices; ++v) {
+      free(song->voices[v].ops);
+      free(song->voices[v].operands);
+      free(song->voices[v].lines);
+      free(song->voices[v].notes);
+      free(song->voices[v].numbers);
+    }
+    for (int l = 0; l < song->n_lfos; ++l) free(song->lfos[l].values);
+    free(song->voices);
+    free(song->lfos);
+  }
+  free(book->songs);
+  free(book->instruments);
+}
+
+// make a directory along with any of its parents which are missing
+void make_dirs(const char *path) {
+  char *dir = strdup(path);
+  for (char *slash = dir + 1; (slash = strchr(slash, '/')); ++slash) {
+    *slash = 0;
+    mkdir(dir, 0777);
+    *slash = '/';
+  }
+  mkdir(dir, 0777);
+  free(dir);
+}
+
+// render every book listed in a manifest, one to a line and each
+// followed by the directory to write its songs to, reporting how each
+// one went; the books share one pool of threads, and every file they
+// include is parsed once for all of them
+int tunebook_batch(const char *manifest) {
+  FILE *list = strcmp(manifest, "-") ? fopen(manifest, "r") : stdin;
+  char *line = NULL;
+  size_t s_line = 0;
+  int n_books = 0, n_failed = 0;
+  if (!list) {
+    fprintf(stderr, "no manifest %s\n", manifest);
+    return -1;
+  }
+  struct tunebook_pool *pool = render_threads > 1 && !dry_run ? pool_start(render_threads) : NULL;
+  include_cache = 1;
+  while (getline(&line, &s_line, list) > 0) {
+    struct tunebook_book book;
+    struct tunebook_error error;
+    char *path = strtok(line, " \t\n"), *dir = strtok(NULL, " \t\n");
+    if (!path || *path == '#') continue;
+    ++n_books;
+    arm_deadline(limits.seconds);
+    FILE *in = fopen(path, "r");
+    if (!in) {
+      fprintf(stderr, "%s: not found\n", path);
+      ++n_failed;
+      continue;
+    }
+    if (dir) make_dirs(dir);
+    output_dir = dir;
+    source_name = strdup(path);
+    source_line = 1;
+    int failed = tunebook_read_file(in, &book, &error) || tunebook_link_book(&book, &error)
+      || tunebook_check_book(&book, &error)
+      || (dry_run ? tunebook_dry_run(&book, &error) : tunebook_write_book(&book, pool, &error));
+    fclose(in);
+    if (failed) {
+      fprintf(stderr, "%s: failed\n", path);
+      tunebook_print_error(error);
+      ++n_failed;
+    } else if (!dry_run) printf("%s: rendered\n", path);
+    fflush(stdout);
+    tunebook_free_book(&book);
+    free(source_name);
+    arm_deadline(0);
+    // a book past its deadline is only a failure, but a signal stops the lot
+    if (atomic_load(&cancelled)) break;
+  }
+  if (!dry_run)
+    printf("%i of %i %s rendered\n", n_books - n_failed, n_books, n_books == 1 ? "book" : "books");
+  if (list != stdin) fclose(list);
+  free(line);
+  if (pool) pool_stop(pool);
+  return n_failed ? -1 : 0;
+}
+
+void usage(void) {
+  fprintf(stderr,
+          "usage: tunebook [options] < book\n"
+          "  --batch FILE       render every book listed in FILE, one to a line and\n"
+          "                     each followed by the directory to write it to\n"
+          "  --compile FILE     write the parsed book to FILE as an image\n"
+          "  --load FILE        render the image in FILE instead of stdin\n"
+          "  --control-rate HZ  update envelopes and glides HZ times a second\n"
+          "  --threads N        compute independent oscillators on N threads\n"
+          "  --split-notes      render each voice's notes in chunks on the threads\n"
+          "  --kernels DIR      compile instruments to C kernels cached in DIR\n"
+          "  --from TIME        start rendering at TIME, in beats or with s seconds\n"
+          "  --to TIME          stop rendering at TIME, in beats or with s seconds\n"
+          "  --song NAME        only render songs matching NAME, which may be a\n"
+          "                     glob and may be given more than once\n"
+          "  --stems            also write every voice to a file of its own\n"
+          "  --format FORMAT    write l16 (the default), wav16, wav24, wav32f,\n"
+          "                     flac16 or flac24\n"
+          "  --direct           write with O_DIRECT into preallocated files\n"
+          "  --dry-run          print what rendering would cost as JSON, and stop\n"
+          "  --profile          report the time spent on each line and instrument\n"
+          "  --profile-folded FILE\n"
+          "                     also write the profile to FILE as folded stacks\n"
+          "  --max-samples N    fail any voice longer than N samples\n"
+          "  --max-evaluations N\n"
+          "                     fail a book taking more than N oscillator evaluations\n"
+          "  --max-memory MB    fail a song needing more than MB of sample buffers\n"
+          "  --max-depth N      nest sections and includes no deeper than N, 64 by\n"
+          "                     default and at most 10000\n"
+          "  --deadline SECONDS stop rendering a book after SECONDS\n");
+}
+
+int main(int argc, char **argv) {
+  struct tunebook_book book;
+  struct tunebook_error error;
+  char *compile = NULL, *load = NULL, *batch = NULL;
+  for (int a = 1; a < argc; ++a) {
+    if (!strcmp(argv[a], "--compile") && a + 1 < argc) compile = argv[++a];
+    else if (!strcmp(argv[a], "--batch") && a + 1 < argc) batch = argv[++a];
+    else if (!strcmp(argv[a], "--load") && a + 1 < argc) load = argv[++a];
+    else if (!strcmp(argv[a], "--kernels") && a + 1 < argc) kernel_dir = argv[++a];
+    else if (!strcmp(argv[a], "--stems")) render_stems = 1;
+    else if (!strcmp(argv[a], "--song") && a + 1 < argc) {
+      RESIZE(song_patterns, n_song_patterns + 1);
+      song_patterns[n_song_patterns++] = argv[++a];
+    }
+    else if (!strcmp(argv[a], "--dry-run")) dry_run = 1;
+    else if (!strcmp(argv[a], "--profile")) profile = 1;
+    else if (!strcmp(argv[a], "--profile-folded") && a + 1 < argc) {
+      profile = 1;
+      profile_folded = argv[++a];
+    }
+    else if (!strcmp(argv[a], "--direct")) output_direct = 1;
+    else if (!strcmp(argv[a], "--format") && a + 1 < argc) {
+      ++a;
+      if (!strcmp(argv[a], "l16")) output_format = FORMAT_L16;
+      else if (!strcmp(argv[a], "wav16")) output_format = FORMAT_WAV16;
+      else if (!strcmp(argv[a], "wav24")) output_format = FORMAT_WAV24;
+      else if (!strcmp(argv[a], "wav32f")) output_format = FORMAT_WAV32F;
+      else if (!strcmp(argv[a], "flac16")) output_format = FORMAT_FLAC16;
+      else if (!strcmp(argv[a], "flac24")) output_format = FORMAT_FLAC24;
+      else {
+        usage();
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[a], "--from") && a + 1 < argc) {
+      if (parse_time(argv[++a], &render_from)) {
+        usage();
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[a], "--to") && a + 1 < argc) {
+      if (parse_time(argv[++a], &render_to)) {
+        usage();
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[a], "--control-rate") && a + 1 < argc) {
+      int rate = atoi(argv[++a]);
+      if (rate <= 0 || rate > SAMPLE_RATE) {
+        usage();
+        return -1;
+      }
+      control_period = SAMPLE_RATE / rate;
+    }
+    else if (!strcmp(argv[a], "--threads") && a + 1 < argc) {
+      render_threads = atoi(argv[++a]);
+      if (render_threads <= 0) {
+        usage();
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[a], "--split-notes")) split_notes = 1;
+    else if (!strcmp(argv[a], "--max-samples") && a + 1 < argc) {
+      limits.samples = atol(argv[++a]);
+      if (limits.samples <= 0) {
+        usage();
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[a], "--max-evaluations") && a + 1 < argc) {
+      limits.evaluations = atoll(argv[++a]);
+      if (limits.evaluations <= 0) {
+        usage();
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[a], "--max-memory") && a + 1 < argc) {
+      limits.memory = atof(argv[++a]) * (1 << 20);
+      if (limits.memory <= 0) {
+        usage();
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[a], "--max-depth") && a + 1 < argc) {
+      limits.depth = atoi(argv[++a]);
+      if (limits.depth <= 0 || limits.depth > MAX_DEPTH) {
+        usage();
+        return -1;
+      }
+    }
+    else if (!strcmp(argv[a], "--deadline") && a + 1 < argc) {
+      limits.seconds = atof(argv[++a]);
+      if (!(limits.seconds > 0)) {
+        usage();
+        return -1;
+      }
+    }
+    else {
+      usage();
+      return -1;
+    }
+  }
+  // the first interrupt stops the book cleanly, and a second one for
+  // good; signals interrupt any read they arrive during, so that a book
+  // coming in slowly stops too
+  struct sigaction cancel = { .sa_handler = cancel_on_signal };
+  sigaction(SIGALRM, &cancel, NULL);
+  cancel.sa_flags = SA_RESETHAND;
+  sigaction(SIGINT, &cancel, NULL);
+  sigaction(SIGTERM, &cancel, NULL);
+  if (batch) {
+    if (compile || load) {
+      usage();
+      return -1;
+    }
+    return tunebook_batch(batch);
+  }
+  arm_deadline(limits.seconds);
+  if (load) {
+    if (tunebook_load_image(load, &book, &error)) goto error;
+  } else {
+    if (tunebook_read_file(stdin, &book, &error)) goto error;
+    if (tunebook_link_book(&book, &error)) goto error;
+  }
+  if (compile) {
+    FILE *out = fopen(compile, "w");
+    if (!out) {
+      error.type = ERROR_FILE_NOT_FOUND;
+      goto error;
+    }
+    if (tunebook_compile_book(&book, out, &error)) goto error;
+    if (fclose(out)) {
+      error.type = ERROR_FILE_NOT_FOUND;
+      goto error;
+    }
+    return 0;
+  }
+  if (tunebook_check_book(&book, &error)) goto error;
+  if (dry_run) {
+    if (tunebook_dry_run(&book, &error)) goto error;
+    return 0;
+  }
+  struct tunebook_pool *pool = render_threads > 1 ? pool_start(render_threads) : NULL;
+  int failed = tunebook_write_book(&book, pool, &error);
+  if (pool) pool_stop(pool);
+  if (failed) goto error;
   return 0;
  error:
   tunebook_print_error(error);